@@ -0,0 +1,158 @@
+// Cost of the reactor loop's reads of ConnSocket, per 10k sockets: for every
+// ready slot the loop takes the pollfd (socket and state) and the deadline
+// of the socket. Slots come ready in no particular order, so they are
+// visited in a random one, with the table in the cache and with the caches
+// evicted, as after the syscalls of a busy iteration.
+//
+// ConnSocket is timed next to plain structs with the field order of its
+// earlier layouts, so the comparison does not need an old tree.
+// Build with "make bench".
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <random>
+#include <vector>
+#include "ConnSocket.hpp"
+
+SSL_CTX_ptr g_ssl_ctx(nullptr, SSL_CTX_free);
+std::unique_ptr<ClientHelloTemplate> g_hello_template;
+bool g_send_close_alert = false;
+SocketOptions g_socket_options;
+
+static constexpr size_t num_of_sockets = 10000;
+static constexpr int runs = 50;
+
+/**
+ * ConnSocket before the hot/cold split: the fields in declaration order,
+ * with enums as int and the framer's counters as size_t
+ **/
+struct unsplit_socket_t
+{
+   unsigned long address = 0;
+   u_short  port = 0;
+   SOCKET   sock = INVALID_SOCKET;
+   SSL_ptr  ssl{ nullptr, SSL_free };
+   int      state = 0;
+   int      result = 0;
+   unsigned long long last_state_change = 0;
+
+   RecvBuffer recv_data;
+   sockaddr_in peer{};
+   int hello_len = 0;
+   size_t ssl_read_pos = 0;
+   bool use_openssl = true;
+   std::vector<uint8_t> hello;
+
+   struct
+   {
+      int      status = 0;
+      uint8_t  header[5] = {};
+      size_t   header_len = 0;
+      uint8_t  record_type = 0;
+      size_t   record_left = 0;
+      bool     encrypted = false;
+      uint8_t  message_header[4] = {};
+      size_t   message_header_len = 0;
+      bool     in_message_body = false;
+      uint8_t  message_type = 0;
+      size_t   message_left = 0;
+   } framer;
+   size_t framed = 0;
+};
+
+/**
+ * The first hot/cold split, with the deadline stamp among the cold fields
+ **/
+struct alignas(64) cold_deadline_socket_t
+{
+   SOCKET   sock = INVALID_SOCKET;
+   uint8_t  state = 0;
+   bool     use_openssl = true;
+   int      result = 0;
+   uint32_t framed = 0;
+   RecvBuffer recv_data;
+   TlsFlightFramer framer;
+
+   unsigned long long last_state_change = 0;
+   size_t   ssl_read_pos = 0;
+   SSL_ptr  ssl{ nullptr, SSL_free };
+   int      hello_len = 0;
+   std::vector<uint8_t> hello;
+   sockaddr_in peer{};
+   unsigned long address = 0;
+   u_short  port = 0;
+   bool     out_of_ports = false;
+};
+
+/**
+ * Best time of a pass over the slots in order, in us, calling
+ * read(socket) for each
+ **/
+template<typename Socket, typename Read>
+static double time_passes(const std::vector<size_t>& order, bool evicted, Read&& read)
+{
+   std::vector<Socket> socks(num_of_sockets);
+
+   // Larger than the last level cache
+   static std::vector<uint8_t> evict(64 * 1024 * 1024);
+
+   double best = 1e30;
+   unsigned long long sum = 0;
+   for (int run = 0; run < runs; ++run)
+   {
+      if (evicted)
+      {
+         for (size_t i = 0; i < evict.size(); i += 64)
+         {
+            evict[i] += 1;
+         }
+      }
+
+      const auto start = std::chrono::steady_clock::now();
+      for (const size_t i : order)
+      {
+         sum += read(socks[i]);
+      }
+      const std::chrono::duration<double, std::micro> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count());
+   }
+
+   // Keeps the reads from being optimized away
+   if (sum == 1)
+   {
+      printf("\n");
+   }
+   return best;
+}
+
+template<typename Socket, typename Read>
+static void report(const char* name, const std::vector<size_t>& order, Read&& read)
+{
+   const double cached = time_passes<Socket>(order, false, read);
+   const double evicted = time_passes<Socket>(order, true, read);
+   printf("%-28s %6zu B %9.1f us %9.1f us\n", name, sizeof(Socket), cached, evicted);
+}
+
+int main()
+{
+   std::vector<size_t> order(num_of_sockets);
+   std::iota(order.begin(), order.end(), 0);
+   std::shuffle(order.begin(), order.end(), std::mt19937_64(1));
+
+   printf("Per 10k sockets:\n%-28s %8s %12s %12s\n", "layout", "size", "cached", "evicted");
+   report<unsplit_socket_t>("before the split", order, [](const unsplit_socket_t& sock) {
+         const short events = (sock.state == 0) ? POLLOUT : POLLIN;
+         return static_cast<unsigned long long>(sock.sock) + events + sock.last_state_change + sock_timeout;
+      });
+   report<cold_deadline_socket_t>("split, deadline cold", order, [](const cold_deadline_socket_t& sock) {
+         const short events = (sock.state == 0) ? POLLOUT : POLLIN;
+         return static_cast<unsigned long long>(sock.sock) + events + sock.last_state_change + sock_timeout;
+      });
+   report<ConnSocket>("ConnSocket", order, [](const ConnSocket& sock) {
+         const pollfd fd = sock.get_pollfd();
+         return static_cast<unsigned long long>(fd.fd) + fd.events + sock.get_deadline();
+      });
+   return 0;
+}
@@ -0,0 +1,69 @@
+// Cost of the two sweep orders, BlackRock and CyclicGroup: IPSpaceSweeper
+// setup, then try_get() per target over sweeps of about 1M, 1G and 4G
+// targets. Sweeps too long to finish are timed over their first 10M targets.
+// Build with "make bench".
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <tuple>
+#include "IPSpaceSweeper.hpp"
+
+static constexpr uint64_t max_targets = 10000000;
+static constexpr int runs = 3;
+
+struct sweep_t
+{
+   const char*    name;
+   const char*    addr;
+   unsigned char  mask;
+};
+
+int main()
+{
+   static const sweep_t sweeps[] = {
+      { "1M", "10.0.0.0", 12 },
+      { "1G", "64.0.0.0", 2 },
+      { "4G", "0.0.0.0", 0 },
+   };
+   static const std::pair<IPSpaceSweeper::Order_e, const char*> orders[] = {
+      { IPSpaceSweeper::Order_e::BlackRock, "blackrock" },
+      { IPSpaceSweeper::Order_e::CyclicGroup, "cyclic" },
+   };
+
+   printf("%8s %10s %12s %10s %14s\n", "sweep", "order", "targets", "setup", "per target");
+   for (const auto& sweep : sweeps)
+   {
+      for (const auto& order : orders)
+      {
+         IPSpaceSweeper sweeper;
+         sweeper.add_range(sweep.addr, sweep.mask);
+         sweeper.set_order(order.first);
+
+         const auto setup_start = std::chrono::steady_clock::now();
+         sweeper.build();
+         const std::chrono::duration<double, std::milli> setup = std::chrono::steady_clock::now() - setup_start;
+
+         const uint64_t num_of_targets = std::get<1>(sweeper.get_stats());
+         const uint64_t count = std::min(num_of_targets, max_targets);
+         double best = 1e30;
+         unsigned long long sum = 0;
+         for (int run = 0; run < runs; ++run)
+         {
+            // Each run sweeps from the start, the copy has its own cursor
+            IPSpaceSweeper copy(sweeper);
+            target_t target;
+            const auto start = std::chrono::steady_clock::now();
+            for (uint64_t i = 0; (i < count) && copy.try_get(&target); ++i)
+            {
+               sum += target.ip;
+            }
+            const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+            best = std::min(best, elapsed.count() / count);
+         }
+         printf("%8s %10s %12llu %7.2f ms %11.1f ns (%llu)\n", sweep.name, order.second,
+                static_cast<unsigned long long>(num_of_targets), setup.count(), best, sum % 10);
+      }
+   }
+   return 0;
+}
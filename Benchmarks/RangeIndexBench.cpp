@@ -0,0 +1,79 @@
+// Cost of RangeIndex lookups by number of ranges: 1M random indices, one at
+// a time and in batches of 64 as IPSpaceSweeper::fill_batch() does them.
+// Build with "make bench".
+#include <cstdio>
+#include <cstdint>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <vector>
+#include "RangeIndex.hpp"
+
+static constexpr size_t num_of_lookups = 1000000;
+static constexpr size_t batch_size = 64;
+static constexpr int runs = 5;
+
+template<typename Func>
+static double best_ns_per_lookup(Func&& func)
+{
+   double best = 1e30;
+   for (int run = 0; run < runs; ++run)
+   {
+      const auto start = std::chrono::steady_clock::now();
+      func();
+      const std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+      best = std::min(best, elapsed.count() / num_of_lookups);
+   }
+   return best;
+}
+
+int main()
+{
+   std::mt19937_64 rand_gen(1);
+   printf("%10s %12s %12s %12s\n", "ranges", "index size", "lookup", "lookup_n");
+
+   for (const size_t num_of_ranges : { size_t(1), size_t(1000), size_t(1000000) })
+   {
+      // Ranges of 1 to 32 addresses, with gaps between them
+      std::vector<RangeIndex::range_t> ranges;
+      for (size_t i = 0; i < num_of_ranges; ++i)
+      {
+         const uint32_t begin = static_cast<uint32_t>(64 * i);
+         ranges.emplace_back(begin, begin + static_cast<uint32_t>(rand_gen() % 32));
+      }
+      const RangeIndex index(std::move(ranges));
+
+      std::vector<uint64_t> indices(num_of_lookups);
+      for (auto& it : indices)
+      {
+         it = rand_gen() % index.get_num_of_ips();
+      }
+
+      std::vector<unsigned long> ips(num_of_lookups);
+      const double single = best_ns_per_lookup([&] {
+            for (size_t i = 0; i < num_of_lookups; ++i)
+            {
+               ips[i] = index.lookup(indices[i]);
+            }
+         });
+
+      std::vector<unsigned long> batched_ips(num_of_lookups);
+      const double batched = best_ns_per_lookup([&] {
+            for (size_t i = 0; i < num_of_lookups; i += batch_size)
+            {
+               index.lookup_n(&indices[i], std::min(batch_size, num_of_lookups - i), &batched_ips[i]);
+            }
+         });
+
+      if (ips != batched_ips)
+      {
+         printf("lookup and lookup_n disagree with %zu ranges\n", num_of_ranges);
+         return 1;
+      }
+
+      // What a lookup reads: the tree, and the offset of the node it ends on
+      const double index_kb = num_of_ranges * 2 * sizeof(uint32_t) / 1e3;
+      printf("%10zu %9.0f KB %9.1f ns %9.1f ns\n", num_of_ranges, index_kb, single, batched);
+   }
+   return 0;
+}
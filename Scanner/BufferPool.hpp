@@ -0,0 +1,286 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <atomic>
+#include <new>
+#include <utility>
+#include <vector>
+
+/**
+ * Piece of a receive buffer. The bytes follow the header in the same
+ * allocation.
+ **/
+struct RecvChunk
+{
+   RecvChunk* next;
+   uint32_t   capacity;
+   uint32_t   used;
+   uint8_t    size_class;
+
+   uint8_t* data() noexcept
+   {
+      return reinterpret_cast<uint8_t*>(this + 1);
+   }
+
+   const uint8_t* data() const noexcept
+   {
+      return reinterpret_cast<const uint8_t*>(this + 1);
+   }
+
+   size_t room() const noexcept
+   {
+      return capacity - used;
+   }
+};
+
+/**
+ * Per-thread cache of receive chunks in a few size classes.
+ *
+ * Chunks are only malloc'ed when the cache of their class is empty, and they
+ * go back to the cache (never to the heap) when a connection is done with
+ * them. So memory follows the number of connections that actually received
+ * something, not the number of slots.
+ **/
+class BufferPool
+{
+public:
+   static constexpr size_t num_of_classes = 3;
+   static constexpr size_t class_size[num_of_classes] = { 2 * 1024, 8 * 1024, 32 * 1024 };
+
+   BufferPool() = default;
+   BufferPool(const BufferPool&) = delete;
+   BufferPool& operator=(const BufferPool&) = delete;
+
+   ~BufferPool()
+   {
+      for (auto& cache : m_cache)
+      {
+         for (auto chunk : cache)
+         {
+            s_allocated_bytes -= sizeof(RecvChunk) + chunk->capacity;
+            free(chunk);
+         }
+      }
+   }
+
+   /**
+    * The pool of the calling thread
+    **/
+   static BufferPool& local()
+   {
+      thread_local BufferPool pool;
+      return pool;
+   }
+
+   /**
+    * Returns nullptr if out of memory
+    **/
+   RecvChunk* acquire(size_t size_class) noexcept
+   {
+      size_class = std::min(size_class, num_of_classes - 1);
+
+      RecvChunk* chunk;
+      auto& cache = m_cache[size_class];
+      if (!cache.empty())
+      {
+         chunk = cache.back();
+         cache.pop_back();
+      }
+      else
+      {
+         void* mem = malloc(sizeof(RecvChunk) + class_size[size_class]);
+         if (mem == nullptr)
+         {
+            return nullptr;
+         }
+
+         chunk = new (mem) RecvChunk;
+         chunk->capacity = static_cast<uint32_t>(class_size[size_class]);
+         chunk->size_class = static_cast<uint8_t>(size_class);
+         s_allocated_bytes += sizeof(RecvChunk) + class_size[size_class];
+      }
+
+      chunk->next = nullptr;
+      chunk->used = 0;
+      return chunk;
+   }
+
+   /**
+    * Takes back a whole chain
+    **/
+   void release(RecvChunk* chain)
+   {
+      while (chain != nullptr)
+      {
+         RecvChunk* next = chain->next;
+         m_cache[chain->size_class].push_back(chain);
+         chain = next;
+      }
+   }
+
+   /**
+    * Bytes held by the pools of all threads, cached or in use
+    **/
+   static size_t get_allocated_bytes() noexcept
+   {
+      return s_allocated_bytes;
+   }
+
+private:
+   std::vector<RecvChunk*> m_cache[num_of_classes];
+
+   static inline std::atomic_size_t s_allocated_bytes{ 0 };
+};
+
+/**
+ * What a connection received, as a chain of pool chunks. The first chunk is
+ * small, since most servers send a few KB or nothing at all, and every chunk
+ * chained after it is one class bigger.
+ **/
+class RecvBuffer
+{
+public:
+   RecvBuffer() = default;
+   RecvBuffer(const RecvBuffer&) = delete;
+   RecvBuffer& operator=(const RecvBuffer&) = delete;
+
+   RecvBuffer(RecvBuffer&& rhs) noexcept :
+      m_head(std::exchange(rhs.m_head, nullptr)),
+      m_tail(std::exchange(rhs.m_tail, nullptr)),
+      m_size(std::exchange(rhs.m_size, 0))
+   {}
+
+   RecvBuffer& operator=(RecvBuffer&& rhs) noexcept
+   {
+      if (this != &rhs)
+      {
+         clear();
+         m_head = std::exchange(rhs.m_head, nullptr);
+         m_tail = std::exchange(rhs.m_tail, nullptr);
+         m_size = std::exchange(rhs.m_size, 0);
+      }
+      return *this;
+   }
+
+   ~RecvBuffer()
+   {
+      clear();
+   }
+
+   size_t size() const noexcept
+   {
+      return m_size;
+   }
+
+   /**
+    * Room at the end of the buffer for the next recv, chaining a chunk if
+    * the last one is (almost) full. Returns nullptr if out of memory.
+    **/
+   uint8_t* reserve(size_t* len) noexcept
+   {
+      if ((m_tail == nullptr) || (m_tail->room() < min_room))
+      {
+         RecvChunk* chunk = BufferPool::local().acquire((m_tail == nullptr) ? 0 : m_tail->size_class + 1);
+         if (chunk == nullptr)
+         {
+            *len = 0;
+            return nullptr;
+         }
+
+         if (m_tail == nullptr)
+         {
+            m_head = chunk;
+         }
+         else
+         {
+            m_tail->next = chunk;
+         }
+         m_tail = chunk;
+      }
+
+      *len = m_tail->room();
+      return m_tail->data() + m_tail->used;
+   }
+
+   /**
+    * Keeps len bytes written where reserve() pointed
+    **/
+   void commit(size_t len) noexcept
+   {
+      m_tail->used += static_cast<uint32_t>(len);
+      m_size += len;
+   }
+
+   /**
+    * Gives every chunk back to the pool
+    **/
+   void clear()
+   {
+      BufferPool::local().release(m_head);
+      m_head = nullptr;
+      m_tail = nullptr;
+      m_size = 0;
+   }
+
+   /**
+    * Calls f(data, len) for every contiguous span of the bytes from pos on
+    **/
+   template<typename F>
+   void for_each_span(size_t pos, F f) const
+   {
+      for (const RecvChunk* chunk = m_head; chunk != nullptr; chunk = chunk->next)
+      {
+         if (pos < chunk->used)
+         {
+            f(chunk->data() + pos, chunk->used - pos);
+            pos = 0;
+         }
+         else
+         {
+            pos -= chunk->used;
+         }
+      }
+   }
+
+   /**
+    * Copies up to len bytes from pos on. Returns how many were copied.
+    **/
+   size_t copy(size_t pos, uint8_t* out, size_t len) const noexcept
+   {
+      size_t copied = 0;
+      for_each_span(pos, [&](const uint8_t* data, size_t span)
+         {
+            const size_t n = std::min(span, len - copied);
+            memcpy(out + copied, data, n);
+            copied += n;
+         });
+      return copied;
+   }
+
+   /**
+    * All the bytes in one piece. Only a chained buffer is copied, into
+    * scratch, which must outlive the returned pointer.
+    **/
+   const uint8_t* contiguous(std::vector<uint8_t>* scratch) const
+   {
+      if (m_head == m_tail)
+      {
+         return (m_head != nullptr) ? m_head->data() : nullptr;
+      }
+
+      scratch->resize(m_size);
+      copy(0, scratch->data(), m_size);
+      return scratch->data();
+   }
+
+private:
+   // A chunk with less room is not worth a recv call of its own
+   static constexpr size_t min_room = 256;
+
+   RecvChunk* m_head = nullptr;
+   RecvChunk* m_tail = nullptr;
+   size_t m_size = 0;
+};
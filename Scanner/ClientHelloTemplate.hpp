@@ -0,0 +1,97 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <vector>
+#include <openssl/ssl.h>
+
+/**
+ * A ClientHello built once by OpenSSL, to be sent as is by every connection.
+ *
+ * Only the client random and the session id are changed per connection, so
+ * scanning needs no key generation, no SSL object and no BIO copies. The
+ * hello offers up to TLS 1.2: the scan is after the server's certificate
+ * flight, which TLS 1.3 would encrypt. A server that only speaks TLS 1.3
+ * answers with an alert, which is stored like any other response.
+ **/
+class ClientHelloTemplate
+{
+public:
+   ClientHelloTemplate()
+   {
+      std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)> ctx(SSL_CTX_new(TLS_client_method()), SSL_CTX_free);
+      if (!ctx || !SSL_CTX_set_max_proto_version(ctx.get(), TLS1_2_VERSION))
+      {
+         throw std::runtime_error("Error creating the SSL context for the ClientHello template");
+      }
+
+      std::unique_ptr<SSL, decltype(&SSL_free)> ssl(SSL_new(ctx.get()), SSL_free);
+      if (!ssl)
+      {
+         throw std::runtime_error("Error creating SSL for the ClientHello template");
+      }
+      SSL_set_connect_state(ssl.get());
+      SSL_set_bio(ssl.get(), BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
+      SSL_do_handshake(ssl.get());
+
+      char* data;
+      const long len = BIO_get_mem_data(SSL_get_wbio(ssl.get()), &data);
+      if (len <= 0)
+      {
+         throw std::runtime_error("OpenSSL produced no ClientHello");
+      }
+      m_hello.assign(data, data + len);
+
+      // Record header (5), handshake header (4) and client_version (2) come
+      // before the random. The session id follows it, after its length byte
+      if ((m_hello.size() < session_id_len_offset + 1) ||
+          (m_hello[0] != record_handshake) || (m_hello[5] != handshake_client_hello) ||
+          (m_hello.size() < session_id_len_offset + 1 + m_hello[session_id_len_offset]))
+      {
+         throw std::runtime_error("Unexpected ClientHello layout");
+      }
+      m_session_id_len = m_hello[session_id_len_offset];
+   }
+
+   size_t size() const noexcept
+   {
+      return m_hello.size();
+   }
+
+   /**
+    * Copies the hello into out, with a new random and session id
+    **/
+   void render(std::vector<uint8_t>* out) const
+   {
+      thread_local std::mt19937_64 rand_gen(std::random_device{}());
+
+      out->assign(m_hello.begin(), m_hello.end());
+      fill_random(out->data() + random_offset, random_len, rand_gen);
+      fill_random(out->data() + session_id_len_offset + 1, m_session_id_len, rand_gen);
+   }
+
+private:
+   static constexpr uint8_t record_handshake = 22;
+   static constexpr uint8_t handshake_client_hello = 1;
+   static constexpr size_t random_offset = 11;
+   static constexpr size_t random_len = 32;
+   static constexpr size_t session_id_len_offset = random_offset + random_len;
+
+   std::vector<uint8_t> m_hello;
+   size_t m_session_id_len = 0;
+
+   static void fill_random(uint8_t* dst, size_t len, std::mt19937_64& rand_gen) noexcept
+   {
+      while (len > 0)
+      {
+         const uint64_t value = rand_gen();
+         const size_t n = std::min(len, sizeof(value));
+         memcpy(dst, &value, n);
+         dst += n;
+         len -= n;
+      }
+   }
+};
@@ -4,6 +4,8 @@
 #include <vector>
 #include <string>
 #include <cmath>
+#include <cstring>
+#include <algorithm>
 #include <system_error>
 #ifdef _WIN32
    #include <WinSock2.h>
@@ -11,6 +13,8 @@
    #define pollfd          WSAPOLLFD
    #define SHUT_RDWR       SD_BOTH
    #define WOULDBLOCK_DEF  WSAEWOULDBLOCK
+   #define INPROGRESS_DEF  WSAEWOULDBLOCK
+   typedef int socklen_t;
 #else
    #include <sys/types.h>
    #include <sys/socket.h>
@@ -20,9 +24,22 @@
    #include <poll.h>
    #include <unistd.h>
    #include <fcntl.h>
+   #ifdef __linux__
+      #include <linux/errqueue.h>
+   #endif
    #define INVALID_SOCKET  -1
    #define closesocket     close
    #define WOULDBLOCK_DEF  EWOULDBLOCK
+   #define INPROGRESS_DEF  EINPROGRESS
+   #define WSAECONNRESET   ECONNRESET
+   #define WSAECONNREFUSED ECONNREFUSED
+   #define WSAEHOSTUNREACH EHOSTUNREACH
+   #define WSAENETUNREACH  ENETUNREACH
+   #define WSAETIMEDOUT    ETIMEDOUT
+   #define WSAEINTR        EINTR
+   #define WSAEACCES       EACCES
+   #define WSAEADDRINUSE   EADDRINUSE
+   #define WSAEADDRNOTAVAIL EADDRNOTAVAIL
    typedef int SOCKET;
    static inline auto WSAGetLastError() { return errno; }
    static unsigned long long GetTickCount64()
@@ -38,6 +55,9 @@
 
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#include "ClientHelloTemplate.hpp"
+#include "BufferPool.hpp"
+#include "TlsFlightFramer.hpp"
 
 using SSL_CTX_ptr = std::unique_ptr<SSL_CTX, decltype(&SSL_CTX_free)>;
 using SSL_ptr = std::unique_ptr<SSL, decltype(&SSL_free)>;
@@ -46,7 +66,85 @@ static constexpr auto sock_timeout = 5000;
 
 extern SSL_CTX_ptr g_ssl_ctx;
 
-class ConnSocket
+// When set, connections send this instead of running an OpenSSL handshake
+extern std::unique_ptr<ClientHelloTemplate> g_hello_template;
+
+// Tell servers we are leaving with a close_notify alert once their flight is in
+extern bool g_send_close_alert;
+
+/**
+ * Options applied to every scan socket. The defaults leave the kernel's
+ * own settings alone; for_scanning() is the profile for many short-lived
+ * connections.
+ **/
+struct SocketOptions
+{
+   // Queue the ICMP errors of the socket (IP_RECVERR, Linux only), so a
+   // target that is administratively filtered can be told from one that
+   // is unreachable
+   bool recv_icmp_errors = false;
+
+   // SO_RCVBUF and SO_SNDBUF (0 = kernel default). A scan only sends a
+   // ClientHello and reads one flight, so small buffers are enough
+   int recv_buffer = 0;
+   int send_buffer = 0;
+
+   // SYN retransmits before connect gives up (TCP_SYNCNT, Linux only, 0 =
+   // kernel default)
+   int syn_retries = 0;
+
+   // How long sent data may stay unacknowledged (TCP_USER_TIMEOUT, ms,
+   // Linux only, 0 = kernel default)
+   unsigned user_timeout = 0;
+
+   // Close with a RST (SO_LINGER 0), so no socket is left in TIME_WAIT
+   bool reset_on_close = false;
+
+   // Send the ClientHello at once (TCP_NODELAY)
+   bool no_delay = false;
+
+   // Local addresses the connections are spread over, round-robin (empty =
+   // the one routing to the target). Each address has its own ephemeral
+   // ports, so more connections can be open at once
+   std::vector<unsigned long> source_addresses;
+
+   static SocketOptions for_scanning(unsigned timeout) noexcept
+   {
+      SocketOptions options;
+      options.recv_buffer = 16 * 1024;
+      options.send_buffer = 4 * 1024;
+      options.syn_retries = syn_retries_within(timeout);
+      options.user_timeout = timeout;
+      options.reset_on_close = true;
+      options.no_delay = true;
+      return options;
+   }
+
+   /**
+    * Most SYN retransmits that are all sent before timeout (ms). The kernel
+    * sends the first one after 1 s and doubles the wait every time, so the
+    * nth goes out after 2^n - 1 s.
+    **/
+   static int syn_retries_within(unsigned timeout) noexcept
+   {
+      int retries = 1;
+      while (((2ull << retries) - 1) * 1000 < timeout)
+      {
+         ++retries;
+      }
+      return retries;
+   }
+};
+
+extern SocketOptions g_socket_options;
+
+/**
+ * Sockets live side by side in a slot table and every event only needs a
+ * few of their fields. Those come first, so handling an event usually
+ * touches one cache line of the socket, and a socket never straddles lines
+ * it does not need.
+ **/
+class alignas(64) ConnSocket
 {
 public:
    ConnSocket(const ConnSocket&) = delete;
@@ -54,22 +152,23 @@ public:
    ConnSocket& operator=(const ConnSocket&) = delete;
    ConnSocket& operator=(ConnSocket&&) = default;
 
-   ConnSocket() : m_ssl(nullptr, SSL_free),
-                  m_lastStateChange{ 0 }
-   {
-      m_recv_data.reserve(6 * 1024);
-   }
+   ConnSocket() : m_lastStateChange{ 0 },
+                  m_ssl(nullptr, SSL_free)
+   {}
 
    inline bool is_connected() const noexcept
    {
       return (m_sock != INVALID_SOCKET);
    }
 
-   bool connect(unsigned long address, unsigned short port) noexcept
+   /**
+    * Creates the socket for address:port without connecting it. Completion based
+    * engines issue the connect themselves, using get_peer().
+    **/
+   bool open(unsigned long address, unsigned short port) noexcept
    {
-      int ret;
-
       m_currentResult = Result_e::TCPHandshakeTimeout;
+      m_out_of_ports = false;
 
       m_sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
       if (m_sock == INVALID_SOCKET)
@@ -79,22 +178,12 @@ public:
       }
 
       #ifdef _WIN32
-         LINGER lin{ 0,0 };
-         ret = setsockopt(m_sock, SOL_SOCKET, SO_LINGER, (const char*)&lin, sizeof(lin));
-         if (ret != 0)
-         {
-            printf("Error setting socket opt - LastError=%d\n", WSAGetLastError());
-            closesocket(m_sock);
-            m_sock = INVALID_SOCKET;
-            return false;
-         }
-
          // Set the socket I/O mode: In this case FIONBIO enables or disables the 
          // blocking mode for the socket based on the numerical value of iMode.
          // If iMode = 0, blocking is enabled; 
          // If iMode != 0, non-blocking mode is enabled.
          unsigned long iMode = 1;
-         ret = ioctlsocket(m_sock, FIONBIO, &iMode);
+         int ret = ioctlsocket(m_sock, FIONBIO, &iMode);
          if (ret != NO_ERROR)
          {
             printf("ioctlsocket failed - LastError=%d\n", WSAGetLastError());
@@ -106,27 +195,52 @@ public:
          fcntl(m_sock, F_SETFL, O_NONBLOCK);
       #endif
 
+      if (!apply_options(g_socket_options) || !bind_source(g_socket_options.source_addresses))
+      {
+         closesocket(m_sock);
+         m_sock = INVALID_SOCKET;
+         return false;
+      }
+
       m_address = address;
       m_port = port;
 
-      sockaddr_in clientService;
-      clientService.sin_family = AF_INET;
-      clientService.sin_addr.s_addr = ntohl(m_address);
-      clientService.sin_port = htons(m_port);
+      m_peer.sin_family = AF_INET;
+      m_peer.sin_addr.s_addr = ntohl(m_address);
+      m_peer.sin_port = htons(m_port);
 
-      ret = ::connect(m_sock, reinterpret_cast<sockaddr*>(&clientService), sizeof(clientService));
+      m_state = State_e::Connecting;
+      m_lastStateChange = GetTickCount64();
+
+      return true;
+   }
+
+   bool connect(unsigned long address, unsigned short port) noexcept
+   {
+      if (!open(address, port))
+      {
+         return false;
+      }
+
+      int ret = ::connect(m_sock, reinterpret_cast<const sockaddr*>(&m_peer), sizeof(m_peer));
       const auto err = WSAGetLastError();
       if (ret != 0)
       {
-         if (err == WSAECONNRESET)
+         if (is_target_error(err))
+         {  // Refused or unreachable right away, which is a result too
+            set_failed(err);
+            closesocket(m_sock);
+            m_sock = INVALID_SOCKET;
+            return false;
+         }
+         else if (is_out_of_ports(err))
          {
-            m_currentResult = Result_e::TCPHandshakeReset;
-            printf("Connection to %08X Reseted\n", m_port);
+            m_out_of_ports = true;
             closesocket(m_sock);
             m_sock = INVALID_SOCKET;
             return false;
          }
-         else if (err != WOULDBLOCK_DEF)
+         else if (err != INPROGRESS_DEF)
          {
             printf("Error connecting socket - ret=%d WSAGetLastError=%d\n", ret, err);
             closesocket(m_sock);
@@ -135,19 +249,22 @@ public:
          }
       }
 
-      m_state = State_e::Connecting;
-      m_lastStateChange = GetTickCount64();
-
       return true;
    }
 
    void disconnect() noexcept
    {
-      shutdown(m_sock, SHUT_RDWR);
+      if (!g_socket_options.reset_on_close)
+      {  // Otherwise the FIN would only be chased by the RST
+         shutdown(m_sock, SHUT_RDWR);
+      }
       closesocket(m_sock);
       m_sock = INVALID_SOCKET;
-      m_ssl.reset();
-      m_recv_data.clear();
+      // m_ssl is kept for the next connection of this slot
+      m_recv_data.clear();   // Back to the thread's pool, the result is stored
+      m_ssl_read_pos = 0;
+      m_framer.reset();
+      m_framed = 0;
    }
 
    pollfd get_pollfd() const noexcept
@@ -156,90 +273,211 @@ public:
    }
 
 
+   /**
+    * When the current state times out, in GetTickCount64() ms
+    **/
+   unsigned long long get_deadline() const noexcept
+   {
+      return m_lastStateChange + sock_timeout;
+   }
+
+   /**
+    * The deadline passed without the socket being done
+    **/
+   void set_timed_out() noexcept
+   {
+      m_currentResult = ((m_state == State_e::Connecting) ? Result_e::TCPHandshakeTimeout : Result_e::TLSHandshakeTimeout);
+   }
+
    /**
     *Returns: 
     *    true when it is done comunicating with the socket
     *    false if there communication is still going on
     **/
-   bool process_poll(pollfd& fda)
+   bool process_poll(short revents)
    {
-      if (fda.revents == 0)
-      {  // Was not signaled. Did it timeout??
-         const auto elapsed = (GetTickCount64() - m_lastStateChange);
-         if (elapsed > sock_timeout)
-         {
-            m_currentResult = ((m_state == State_e::Connecting) ? Result_e::TCPHandshakeTimeout : Result_e::TLSHandshakeTimeout);
-            return true;
-         }
-         else
-         {
-            return false;
-         }
+      if ((m_state == State_e::Connecting) && (revents & (POLLERR | POLLHUP)))
+      {  // Refused, unreachable or filtered. Engines may also flag POLLOUT
+         set_failed(get_socket_error());
+         return true;
       }
-      else if ((m_state == State_e::Connecting) && (fda.revents & POLLOUT))
+      else if ((m_state == State_e::Connecting) && (revents & POLLOUT))
       {
-         m_ssl.reset(SSL_new(g_ssl_ctx.get()));
-         SSL_set_connect_state(m_ssl.get());
-         SSL_set_bio(m_ssl.get(), BIO_new(BIO_s_mem()), BIO_new(BIO_s_mem()));
-         SSL_do_handshake(m_ssl.get());
-
-         char outbuf[4096];
-         int read = BIO_read(SSL_get_wbio(m_ssl.get()), outbuf, sizeof(outbuf));
-         if (read <= 0)
+         const char* hello;
+         const int len = start_handshake(&hello);
+         if (len <= 0)
          {
-            printf("Error reading BIO\n");
             return true;
          }
 
-         if (!send(outbuf, read))
+         if (!send(hello, len))
          {
             return true;
          }
 
-         m_lastStateChange = GetTickCount64();
-         m_state = State_e::WaitingReception;
-         fda.revents = 0;
-         fda.events = POLLIN;
-
+         handshake_sent();
          return false;
       }
-      else if ((m_state == State_e::WaitingReception) && (fda.revents & POLLIN))
+      else if ((m_state == State_e::WaitingReception) && (revents & POLLIN))
       {
-         char outbuf[4096];
-         int read = recv(outbuf, sizeof(outbuf));
-         if (read > 0)
+         // Drain everything that is available. Edge-triggered engines will not
+         // signal again for data that is already queued in the socket, nor
+         // for an error that was left pending
+         for (;;)
          {
-            m_recv_data.insert(m_recv_data.end(), outbuf, outbuf + read);
-            BIO_write(SSL_get_rbio(m_ssl.get()), outbuf, read);
+            unsigned len;
+            uint8_t* buf = get_recv_buffer(&len);
+            if (len == 0)
+            {
+               return fail_out_of_buffers();
+            }
+
+            const int read = recv(reinterpret_cast<char*>(buf), static_cast<int>(len));
+            if (read > 0)
+            {
+               commit_recv(read);
+               continue;
+            }
+            else if (read == 0)
+            {
+               return continue_handshake(true);
+            }
+
+            // Engines can flag an error or a hangup together with POLLIN.
+            // Then nothing more is coming, whether recv reports it or not
+            int err = WSAGetLastError();
+            if ((err == WOULDBLOCK_DEF) && (revents & (POLLERR | POLLHUP)))
+            {
+               err = get_socket_error();
+            }
+            else if (err == WOULDBLOCK_DEF)
+            {
+               return continue_handshake(false);
+            }
+
+            if (err != WSAEINTR)
+            {  // What came in before the error may still be the whole flight
+               if (!continue_handshake(false))
+               {
+                  set_failed(err);
+               }
+               return true;
+            }
          }
+      }
+      else if (revents & (POLLERR | POLLHUP))
+      {
+         set_failed(get_socket_error());
+         return true;
+      }
+      else if (revents & (POLLIN | POLLOUT))
+      {  // Ready in a direction the current state does not care about
+         return false;
+      }
+      else
+      {
+         printf("Signaled incorrectly - revents=0x%X\n", revents);
+         return true;
+      }
+   }
+
+   /**
+    * Completion based I/O. The engine issues connect, send and recv on behalf of
+    * the socket and hands it their results. Every complete_* returns true when
+    * it is done comunicating with the socket.
+    **/
+   const sockaddr_in& get_peer() const noexcept
+   {
+      return m_peer;
+   }
 
-         SSL_do_handshake(m_ssl.get());
-         fda.revents = 0;
+   SOCKET get_socket() const noexcept
+   {
+      return m_sock;
+   }
 
-         if (0 != BIO_pending(SSL_get_wbio(m_ssl.get())))
+   /**
+    * On success, data/len point to the ClientHello that must be sent next
+    **/
+   bool complete_connect(int res, const char** data, int* len) noexcept
+   {
+      if (res < 0)
+      {
+         if (is_out_of_ports(-res))
          {
-            m_currentResult = Result_e::TLSHandshakeCompleted;
-            return true;
+            m_out_of_ports = true;
          }
          else
          {
-            return false;
+            set_failed(-res);
          }
+         return true;
       }
-      else if (fda.revents & POLLHUP)
+
+      *len = start_handshake(data);
+      return (*len <= 0);
+   }
+
+   bool complete_send(int res) noexcept
+   {
+      if (res != m_hello_len)
       {
-         m_currentResult = ((m_state == State_e::Connecting) ? Result_e::TCPHandshakeReset : Result_e::TLSHandshakeReset);
+         if (-res == WSAECONNRESET)
+         {
+            m_currentResult = Result_e::TLSHandshakeReset;
+         }
+         printf("Error sending data - ret=%d\n", res);
          return true;
       }
-      else
+
+      handshake_sent();
+      return false;
+   }
+
+   /**
+    * Where the next recv must write to: the end of the result buffer, which
+    * is also where OpenSSL reads from. The first call takes a chunk from
+    * the thread's BufferPool. If the pool is out of memory, len is 0 and the
+    * probe has to end with fail_out_of_buffers().
+    **/
+   uint8_t* get_recv_buffer(unsigned* len)
+   {
+      size_t room;
+      uint8_t* buf = m_recv_data.reserve(&room);
+      *len = static_cast<unsigned>(room);
+      return buf;
+   }
+
+   bool complete_recv(int res) noexcept
+   {
+      if (res < 0)
       {
-         printf("Signaled incorrectly\n");
-         system("pause");
+         if (!continue_handshake(false))
+         {
+            set_failed(-res);
+         }
          return true;
       }
+
+      commit_recv(res);
+      return continue_handshake(res == 0);
    }
 
-   enum class Result_e
+   /**
+    * Ends the probe when the thread's BufferPool has no room left for the
+    * response. Returns true, like the complete_* calls.
+    **/
+   bool fail_out_of_buffers() noexcept
+   {
+      printf("Out of receive buffers\n");
+      if (!continue_handshake(false))
+      {
+         m_currentResult = Result_e::RecvBuffersExhausted;
+      }
+      return true;
+   }
+
+   enum class Result_e : uint8_t
    {
       TCPHandshakeTimeout = 0,
       TCPHandshakeReset = 1,
@@ -247,8 +485,39 @@ public:
       TLSHandshakeTimeout = 3,
       TLSHandshakeReset = 4,
       TLSHandshakeCompleted = 5,
+      TCPConnectionRefused = 6,   // RST to the SYN
+      TCPUnreachable = 7,         // ICMP host or network unreachable
+      TCPFiltered = 8,            // ICMP administratively prohibited, or a local rule
+      RecvBuffersExhausted = 9,   // No memory left in the scanner for the response
+      TLSAlert = 10,              // The server refused the handshake with an alert
+      NotTLS = 11,                // The reply is not TLS, like an HTTP or SSH banner
    };
 
+   /**
+    * The target answered the SYN with an error, so its slot was freed
+    * without waiting for the timeout
+    **/
+   static bool is_fast_failure(Result_e result) noexcept
+   {
+      return (result == Result_e::TCPConnectionRefused) ||
+             (result == Result_e::TCPUnreachable) ||
+             (result == Result_e::TCPFiltered);
+   }
+
+   bool has_failed_fast() const noexcept
+   {
+      return is_fast_failure(m_currentResult);
+   }
+
+   /**
+    * The last connection could not be made because no local port was free.
+    * That says nothing about the target, which has to be tried again.
+    **/
+   bool has_run_out_of_ports() const noexcept
+   {
+      return m_out_of_ports;
+   }
+
    struct conn_result_t
    {
       unsigned long  ip;
@@ -258,34 +527,474 @@ public:
       size_t         data_len;
    };
 
-   inline conn_result_t get_result() const noexcept
+   /**
+    * data stays valid until the socket is disconnected, or until the next
+    * get_result of the thread if the response took more than one chunk
+    **/
+   inline conn_result_t get_result() const
    {
+      thread_local std::vector<uint8_t> scratch;
+
       conn_result_t ret;
       ret.ip       = m_address;
       ret.port     = m_port;
       ret.result   = m_currentResult;
-      ret.data     = m_recv_data.data();
+      ret.data     = m_recv_data.contiguous(&scratch);
       ret.data_len = m_recv_data.size();
 
       return ret;
    }
 
 private:
-   enum class State_e
+   enum class State_e : uint8_t
    {
       Connecting,
       WaitingReception,
    };
-   
-   unsigned long m_address = 0;
-   u_short  m_port   = 0;
+
+   // Hot: used by every event of the connection, the deadline included since
+   // the reactor rearms the timer after each one. With a 4 bytes SOCKET they
+   // fill exactly the first cache line
    SOCKET   m_sock   = INVALID_SOCKET;
-   SSL_ptr  m_ssl; 
    State_e  m_state  = State_e::Connecting;
+   bool     m_use_openssl = true;
    Result_e m_currentResult = Result_e::TCPHandshakeTimeout;
    unsigned long long m_lastStateChange;
+   RecvBuffer m_recv_data;
+   TlsFlightFramer m_framer;
+
+   // Cold: used on state changes, once per connection, or only once data
+   // came in, next to what the OpenSSL handshake uses
+   uint32_t m_framed = 0;       // Bytes of m_recv_data that m_framer already saw
+   size_t m_ssl_read_pos = 0;   // Bytes of m_recv_data that OpenSSL already read
+   SSL_ptr  m_ssl;
+   int m_hello_len = 0;
+   std::vector<uint8_t> m_hello;
+   sockaddr_in m_peer{};
+   unsigned long m_address = 0;
+   u_short  m_port   = 0;
+   bool     m_out_of_ports = false;
+
+   /**
+    * Keeps the bytes of a recv of res bytes into the space given by
+    * get_recv_buffer
+    **/
+   void commit_recv(int res) noexcept
+   {
+      if (res > 0)
+      {
+         m_recv_data.commit(static_cast<size_t>(res));
+      }
+   }
+
+   /**
+    * Bytes received that OpenSSL did not read yet
+    **/
+   size_t ssl_unread() const noexcept
+   {
+      return m_recv_data.size() - m_ssl_read_pos;
+   }
+
+   /**
+    * OpenSSL reads the server's bytes through this BIO, straight from
+    * m_recv_data where recv() wrote them, instead of from a copy in a
+    * memory BIO
+    **/
+   static BIO_METHOD* recv_bio_method() noexcept
+   {
+      static BIO_METHOD* method = []()
+         {
+            BIO_METHOD* m = BIO_meth_new(BIO_get_new_index() | BIO_TYPE_SOURCE_SINK, "ConnSocket recv");
+            BIO_meth_set_read(m, recv_bio_read);
+            BIO_meth_set_ctrl(m, recv_bio_ctrl);
+            return m;
+         }();
+      return method;
+   }
 
-   std::vector<uint8_t> m_recv_data;
+   static int recv_bio_read(BIO* bio, char* out, int len)
+   {
+      auto sock = static_cast<ConnSocket*>(BIO_get_data(bio));
+      BIO_clear_retry_flags(bio);
+
+      const size_t n = sock->m_recv_data.copy(sock->m_ssl_read_pos, reinterpret_cast<uint8_t*>(out), static_cast<size_t>(len));
+      if (n == 0)
+      {
+         BIO_set_retry_read(bio);
+         return -1;
+      }
+
+      sock->m_ssl_read_pos += n;
+      return static_cast<int>(n);
+   }
+
+   static long recv_bio_ctrl(BIO* bio, int cmd, long, void*)
+   {
+      auto sock = static_cast<ConnSocket*>(BIO_get_data(bio));
+      switch (cmd)
+      {
+      case BIO_CTRL_PENDING:
+         return static_cast<long>(sock->ssl_unread());
+      case BIO_CTRL_RESET:
+         sock->m_ssl_read_pos = 0;
+         return 1;
+      case BIO_CTRL_FLUSH:
+         return 1;
+      default:
+         return 0;
+      }
+   }
+
+   /**
+    * Gets m_ssl ready for a new handshake. The SSL object and its BIOs are
+    * created on the first connection of the socket and only reset for the
+    * following ones.
+    **/
+   bool prepare_ssl() noexcept
+   {
+      if (!m_ssl)
+      {
+         m_ssl.reset(SSL_new(g_ssl_ctx.get()));
+         if (!m_ssl)
+         {
+            printf("Error creating SSL\n");
+            return false;
+         }
+         BIO* rbio = BIO_new(recv_bio_method());
+         BIO_set_init(rbio, 1);
+         SSL_set_bio(m_ssl.get(), rbio, BIO_new(BIO_s_mem()));
+      }
+      else
+      {
+         // Without this, SSL_clear would offer the last server's session to
+         // the next one
+         SSL_set_session(m_ssl.get(), nullptr);
+         SSL_clear(m_ssl.get());
+         (void)BIO_reset(SSL_get_wbio(m_ssl.get()));
+      }
+
+      // The socket does not move while connected, but it may have moved
+      // since the BIO was made
+      BIO_set_data(SSL_get_rbio(m_ssl.get()), this);
+      m_ssl_read_pos = 0;
+
+      SSL_set_connect_state(m_ssl.get());
+      return true;
+   }
+
+   /**
+    * Starts the TLS handshake. Returns the length of the ClientHello that
+    * data points to, or <= 0 on error.
+    **/
+   int start_handshake(const char** data) noexcept
+   {
+      m_use_openssl = !g_hello_template;
+      if (!m_use_openssl)
+      {
+         g_hello_template->render(&m_hello);
+         *data = reinterpret_cast<const char*>(m_hello.data());
+         m_hello_len = static_cast<int>(m_hello.size());
+         return m_hello_len;
+      }
+
+      if (!prepare_ssl())
+      {
+         return -1;
+      }
+      SSL_do_handshake(m_ssl.get());
+
+      char* outbuf;
+      const long read = BIO_get_mem_data(SSL_get_wbio(m_ssl.get()), &outbuf);
+      if (read <= 0)
+      {
+         printf("Error reading BIO\n");
+         return -1;
+      }
+
+      *data = outbuf;
+      m_hello_len = static_cast<int>(read);
+      return m_hello_len;
+   }
+
+   void handshake_sent() noexcept
+   {
+      if (m_use_openssl)
+      {
+         (void)BIO_reset(SSL_get_wbio(m_ssl.get()));
+      }
+      m_lastStateChange = GetTickCount64();
+      m_state = State_e::WaitingReception;
+   }
+
+   bool set_option(int level, int name, int value) noexcept
+   {
+      if (setsockopt(m_sock, level, name, reinterpret_cast<const char*>(&value), sizeof(value)) != 0)
+      {
+         printf("Error setting socket opt %d - LastError=%d\n", name, WSAGetLastError());
+         return false;
+      }
+      return true;
+   }
+
+   bool apply_options(const SocketOptions& options) noexcept
+   {
+      if (options.reset_on_close)
+      {
+         #ifdef _WIN32
+            LINGER lin{ 1, 0 };
+         #else
+            linger lin{ 1, 0 };
+         #endif
+         if (setsockopt(m_sock, SOL_SOCKET, SO_LINGER, reinterpret_cast<const char*>(&lin), sizeof(lin)) != 0)
+         {
+            printf("Error setting socket opt - LastError=%d\n", WSAGetLastError());
+            return false;
+         }
+      }
+
+      if (((options.recv_buffer > 0) && !set_option(SOL_SOCKET, SO_RCVBUF, options.recv_buffer)) ||
+          ((options.send_buffer > 0) && !set_option(SOL_SOCKET, SO_SNDBUF, options.send_buffer)) ||
+          (options.no_delay && !set_option(IPPROTO_TCP, TCP_NODELAY, 1)))
+      {
+         return false;
+      }
+
+      #ifdef __linux__
+         if ((options.recv_icmp_errors && !set_option(IPPROTO_IP, IP_RECVERR, 1)) ||
+             ((options.syn_retries > 0) && !set_option(IPPROTO_TCP, TCP_SYNCNT, options.syn_retries)) ||
+             ((options.user_timeout > 0) && !set_option(IPPROTO_TCP, TCP_USER_TIMEOUT, static_cast<int>(options.user_timeout))))
+         {
+            return false;
+         }
+      #endif
+
+      return true;
+   }
+
+   /**
+    * Binds the socket to the next of addresses, if there are any
+    **/
+   bool bind_source(const std::vector<unsigned long>& addresses) noexcept
+   {
+      if (addresses.empty())
+      {
+         return true;
+      }
+
+      thread_local size_t next_address = 0;
+      const auto address = addresses[next_address++ % addresses.size()];
+
+      sockaddr_in local{};
+      local.sin_family = AF_INET;
+      local.sin_addr.s_addr = htonl(address);
+
+      // Leave the port to connect(), which only needs it to be unique for
+      // the whole address and port pair, instead of reserving one for the
+      // source address alone
+      #ifdef __linux__
+         if (!set_option(IPPROTO_IP, IP_BIND_ADDRESS_NO_PORT, 1))
+         {
+            return false;
+         }
+      #elif defined(SO_REUSE_UNICASTPORT)
+         if (!set_option(SOL_SOCKET, SO_REUSE_UNICASTPORT, 1))
+         {
+            return false;
+         }
+      #endif
+
+      if (bind(m_sock, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) != 0)
+      {
+         // Not available here means the address is not local, not that it
+         // has no port left
+         const auto err = WSAGetLastError();
+         if (is_out_of_ports(err) && (err != WSAEADDRNOTAVAIL))
+         {
+            m_out_of_ports = true;
+         }
+         else
+         {
+            printf("Error binding socket to 0x%08lX - LastError=%d\n", address, err);
+         }
+         return false;
+      }
+      return true;
+   }
+
+   static bool is_out_of_ports(int err) noexcept
+   {
+      #ifdef _WIN32
+         return (err == WSAEADDRNOTAVAIL) || (err == WSAEADDRINUSE) || (err == WSAENOBUFS);
+      #else
+         return (err == WSAEADDRNOTAVAIL) || (err == WSAEADDRINUSE);
+      #endif
+   }
+
+   static bool is_target_error(int err) noexcept
+   {
+      return (err == WSAECONNRESET) || (err == WSAECONNREFUSED) || (err == WSAEHOSTUNREACH) || (err == WSAENETUNREACH) ||
+             is_prohibited_locally(err);
+   }
+
+   /**
+    * A route or firewall rule of this host rejects the target
+    **/
+   static bool is_prohibited_locally(int err) noexcept
+   {
+      #ifdef _WIN32
+         return err == WSAEACCES;
+      #else
+         return (err == WSAEACCES) || (err == EPERM);
+      #endif
+   }
+
+   /**
+    * Pending error of the socket, which reading clears
+    **/
+   int get_socket_error() const noexcept
+   {
+      int err = 0;
+      socklen_t len = sizeof(err);
+      if (getsockopt(m_sock, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &len) != 0)
+      {
+         return WSAGetLastError();
+      }
+      return err;
+   }
+
+   /**
+    * Sets the result of a connection that failed with err
+    **/
+   void set_failed(int err) noexcept
+   {
+      if (m_state != State_e::Connecting)
+      {
+         m_currentResult = (err == WSAETIMEDOUT) ? Result_e::TLSHandshakeTimeout : Result_e::TLSHandshakeReset;
+         return;
+      }
+
+      switch (err)
+      {
+      case WSAECONNREFUSED:
+         m_currentResult = Result_e::TCPConnectionRefused;
+         break;
+      case WSAEHOSTUNREACH:
+      case WSAENETUNREACH:
+         m_currentResult = is_filtered() ? Result_e::TCPFiltered : Result_e::TCPUnreachable;
+         break;
+      case WSAETIMEDOUT:
+         m_currentResult = Result_e::TCPHandshakeTimeout;
+         break;
+      default:
+         m_currentResult = is_prohibited_locally(err) ? Result_e::TCPFiltered : Result_e::TCPHandshakeReset;
+         break;
+      }
+   }
+
+   /**
+    * Whether the ICMP error queued for the socket says the target is
+    * administratively prohibited. Needs IP_RECVERR.
+    **/
+   bool is_filtered() const noexcept
+   {
+      #ifdef __linux__
+         if (!g_socket_options.recv_icmp_errors)
+         {
+            return false;
+         }
+
+         char control[256];
+         msghdr msg{};
+         msg.msg_control = control;
+         msg.msg_controllen = sizeof(control);
+
+         bool filtered = false;
+         while (recvmsg(m_sock, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) >= 0)
+         {
+            for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg != nullptr; cmsg = CMSG_NXTHDR(&msg, cmsg))
+            {
+               if ((cmsg->cmsg_level == IPPROTO_IP) && (cmsg->cmsg_type == IP_RECVERR))
+               {
+                  auto ee = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+                  // Destination unreachable: network (9), host (10) or
+                  // communication (13) administratively prohibited
+                  filtered |= (ee->ee_origin == SO_EE_ORIGIN_ICMP) && (ee->ee_type == 3) &&
+                              ((ee->ee_code == 9) || (ee->ee_code == 10) || (ee->ee_code == 13));
+               }
+            }
+            msg.msg_controllen = sizeof(control);
+         }
+         return filtered;
+      #else
+         return false;
+      #endif
+   }
+
+   /**
+    * The framer ends the probe as soon as the server's certificate flight is
+    * in, or as soon as the server refuses with an alert or answers with
+    * something else than TLS. Only a flight it cannot follow (TLS 1.3) needs
+    * OpenSSL to say when the server is done.
+    **/
+   bool continue_handshake(bool peer_closed) noexcept
+   {
+      m_recv_data.for_each_span(m_framed, [&](const uint8_t* data, size_t len)
+         {
+            m_framer.feed(data, len);
+         });
+      m_framed = static_cast<uint32_t>(m_recv_data.size());
+
+      bool flight_done = false;
+      switch (m_framer.get_status())
+      {
+      case TlsFlightFramer::Status_e::Done:
+         flight_done = true;
+         break;
+      case TlsFlightFramer::Status_e::Alert:
+         m_currentResult = Result_e::TLSAlert;
+         return true;
+      case TlsFlightFramer::Status_e::NotTls:
+         m_currentResult = Result_e::NotTLS;
+         return true;
+      case TlsFlightFramer::Status_e::NeedMore:
+         if (m_use_openssl)
+         {
+            SSL_do_handshake(m_ssl.get());
+            flight_done = (0 != BIO_pending(SSL_get_wbio(m_ssl.get())));
+         }
+         break;
+      }
+
+      if (flight_done)
+      {
+         m_currentResult = Result_e::TLSHandshakeCompleted;
+         if (g_send_close_alert)
+         {
+            send_close_alert();
+         }
+         return true;
+      }
+      else if (peer_closed)
+      {
+         m_currentResult = Result_e::TLSHandshakeReset;
+         return true;
+      }
+      else
+      {
+         return false;
+      }
+   }
+
+   /**
+    * Best effort: the socket is closed right after, whether it went out or not
+    **/
+   void send_close_alert() noexcept
+   {
+      // Plaintext warning(1) close_notify(0). Nothing is encrypted before the
+      // client's Finished, which we never send
+      static constexpr char close_notify[] = { 21, 3, 3, 0, 2, 1, 0 };
+      (void)::send(m_sock, close_notify, sizeof(close_notify), 0);
+   }
 
    inline bool send(const char* data, int len) noexcept
    {
@@ -0,0 +1,74 @@
+#pragma once
+#include <vector>
+#include <thread>
+#ifdef _WIN32
+   #include <Windows.h>
+#else
+   #include <sched.h>
+#endif
+
+/**
+ * CPUs this process may run on, in order. Falls back to 0..N-1 where the
+ * affinity of the process cannot be read.
+ **/
+static std::vector<unsigned> get_usable_cpus()
+{
+   std::vector<unsigned> cpus;
+
+   #ifdef _WIN32
+      DWORD_PTR process_mask = 0;
+      DWORD_PTR system_mask = 0;
+      if (GetProcessAffinityMask(GetCurrentProcess(), &process_mask, &system_mask))
+      {
+         for (unsigned cpu = 0; cpu < sizeof(process_mask) * 8; ++cpu)
+         {
+            if (process_mask & (static_cast<DWORD_PTR>(1) << cpu))
+            {
+               cpus.push_back(cpu);
+            }
+         }
+      }
+   #elif defined(__linux__)
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      {
+         for (unsigned cpu = 0; cpu < CPU_SETSIZE; ++cpu)
+         {
+            if (CPU_ISSET(cpu, &set))
+            {
+               cpus.push_back(cpu);
+            }
+         }
+      }
+   #endif
+
+   if (cpus.empty())
+   {
+      const unsigned num_of_cpus = std::thread::hardware_concurrency();
+      for (unsigned cpu = 0; (cpu == 0) || (cpu < num_of_cpus); ++cpu)
+      {
+         cpus.push_back(cpu);
+      }
+   }
+   return cpus;
+}
+
+/**
+ * Keeps the calling thread on cpu. Memory the thread touches first from
+ * then on is allocated on the NUMA node of that CPU, by the default policy
+ * of both Linux and Windows.
+ **/
+static bool pin_current_thread(unsigned cpu)
+{
+   #ifdef _WIN32
+      return SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu) != 0;
+   #elif defined(__linux__)
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpu, &set);
+      return sched_setaffinity(0, sizeof(set), &set) == 0;
+   #else
+      return false;
+   #endif
+}
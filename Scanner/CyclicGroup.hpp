@@ -0,0 +1,300 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#ifdef _MSC_VER
+   #include <intrin.h>
+#endif
+
+/**
+ * Visits the indices 0..range-1 in the order of a cyclic multiplicative
+ * group, as zmap does. With p the first prime above range and g a random
+ * primitive root of p, the elements x0 * g^i mod p run through all of
+ * 1..p-1 once before they repeat. Element x stands for index x-1, and the
+ * p-1-range elements past the range are skipped.
+ *
+ * A step costs one multiplication mod p, whatever the index. Unlike the
+ * cycle walking of BlackRock there is no loop per index: the only skipped
+ * elements are the gap up to the next prime, a few dozen for most ranges
+ * and under 1600 for any, over the whole sweep.
+ **/
+class CyclicGroup
+{
+public:
+   // Consecutive positions stepped side by side, so their multiplications
+   // overlap
+   static constexpr size_t lanes = 4;
+
+   /**
+    * Where a sweep is in the cycle: the elements at position and at the
+    * lanes - 1 positions after it. Each sweep has its own.
+    **/
+   struct cursor_t
+   {
+      uint64_t position = UINT64_MAX;
+      uint64_t element[lanes] = {};
+   };
+
+   CyclicGroup() = default;
+
+   CyclicGroup(uint64_t range, uint64_t seed) :
+      m_range(range)
+   {
+      if ((range == 0) || (range >= (uint64_t(1) << 62)))
+      {
+         throw std::invalid_argument("No cyclic group for a range of " + std::to_string(range));
+      }
+
+      // Odd, for Montgomery multiplication: 3 stands in for 2
+      uint64_t p = std::max<uint64_t>(range + 1, 3) | 1;
+      while (!is_prime(p))
+      {
+         p += 2;
+      }
+      m_mod = montgomery_t(p);
+
+      // A random generator of the whole group: g^((p-1)/q) != 1 for every
+      // prime factor q of p-1
+      std::mt19937_64 rand_gen(seed);
+      const auto factors = prime_factors(p - 1);
+      uint64_t g = 2;
+      for (bool is_generator = false; !is_generator; )
+      {
+         g = (p > 3) ? std::uniform_int_distribution<uint64_t>(2, p - 2)(rand_gen) : 2;
+         const uint64_t g_m = m_mod.to(g);
+         is_generator = std::none_of(factors.begin(), factors.end(), [&](uint64_t q) {
+               return m_mod.pow(g_m, (p - 1) / q) == m_mod.one;
+            });
+      }
+
+      // Multiplying by a number in Montgomery form multiplies by the number
+      // itself, so the elements stay in plain form
+      m_generator = m_mod.to(g);
+      m_step = m_mod.pow(m_generator, lanes);
+      m_first = std::uniform_int_distribution<uint64_t>(1, p - 1)(rand_gen);
+   }
+
+   /**
+    * Positions in the cycle. Slightly more than the range, the positions
+    * of the skipped elements included.
+    **/
+   uint64_t get_length() const noexcept
+   {
+      return m_mod.p - 1;
+   }
+
+   /**
+    * Writes the indices at the count positions from first on into out,
+    * leaving out the skipped elements. Returns how many it wrote. Picks up
+    * from cursor when it is at first, and else seeks to first.
+    **/
+   size_t permute_n(cursor_t& cursor, uint64_t first, size_t count, uint64_t* out) const noexcept
+   {
+      if (cursor.position != first)
+      {
+         seek(cursor, first);
+      }
+
+      size_t num_of_indices = 0;
+      for (size_t i = 0; i < count; i += lanes)
+      {
+         const size_t num_of_lanes = std::min(lanes, count - i);
+         for (size_t lane = 0; lane < num_of_lanes; ++lane)
+         {
+            const uint64_t index = cursor.element[lane] - 1;
+            out[num_of_indices] = index;
+            num_of_indices += (index < m_range);
+         }
+         for (size_t lane = 0; lane < lanes; ++lane)
+         {
+            cursor.element[lane] = m_mod.mul(cursor.element[lane], m_step);
+         }
+      }
+
+      // A partial step leaves the lanes out of line
+      cursor.position = (count % lanes == 0) ? first + count : UINT64_MAX;
+      return num_of_indices;
+   }
+
+private:
+   /**
+    * Multiplication mod an odd p < 2^63 without a division: mul(a, b) is
+    * a * b / 2^64 mod p
+    **/
+   struct montgomery_t
+   {
+      uint64_t p = 3;
+      uint64_t inverse = 0;   // p * inverse = 1 mod 2^64
+      uint64_t one = 0;       // 2^64 mod p, 1 in Montgomery form
+      uint64_t r2 = 0;        // 2^128 mod p
+
+      montgomery_t() = default;
+
+      explicit montgomery_t(uint64_t modulus) noexcept :
+         p(modulus),
+         inverse(modulus)
+      {
+         // Each Newton step doubles the bits that are right, from 3
+         for (int i = 0; i < 5; ++i)
+         {
+            inverse *= 2 - p * inverse;
+         }
+
+         one = (0 - p) % p;
+         r2 = one;
+         for (int i = 0; i < 64; ++i)
+         {
+            r2 <<= 1;
+            r2 -= (r2 >= p) ? p : 0;
+         }
+      }
+
+      uint64_t mul(uint64_t a, uint64_t b) const noexcept
+      {
+         uint64_t high;
+         const uint64_t low = mul128(a, b, &high);
+         uint64_t m_high;
+         mul128(low * inverse, p, &m_high);
+         return (high < m_high) ? high - m_high + p : high - m_high;
+      }
+
+      uint64_t to(uint64_t a) const noexcept
+      {
+         return mul(a % p, r2);
+      }
+
+      /**
+       * base^e, in Montgomery form like base
+       **/
+      uint64_t pow(uint64_t base, uint64_t e) const noexcept
+      {
+         uint64_t result = one;
+         for (; e; e >>= 1)
+         {
+            if (e & 1)
+            {
+               result = mul(result, base);
+            }
+            base = mul(base, base);
+         }
+         return result;
+      }
+   };
+
+   uint64_t m_range = 0;
+   montgomery_t m_mod;
+   uint64_t m_generator = 0;   // g in Montgomery form
+   uint64_t m_step = 0;        // g^lanes in Montgomery form
+   uint64_t m_first = 1;       // Element at position 0
+
+   void seek(cursor_t& cursor, uint64_t position) const noexcept
+   {
+      cursor.position = position;
+      cursor.element[0] = m_mod.mul(m_first, m_mod.pow(m_generator, position));
+      for (size_t lane = 1; lane < lanes; ++lane)
+      {
+         cursor.element[lane] = m_mod.mul(cursor.element[lane - 1], m_generator);
+      }
+   }
+
+   static uint64_t mul128(uint64_t a, uint64_t b, uint64_t* high) noexcept
+   {
+      #if defined(__SIZEOF_INT128__)
+         const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+         *high = static_cast<uint64_t>(product >> 64);
+         return static_cast<uint64_t>(product);
+      #elif defined(_MSC_VER) && defined(_M_X64)
+         return _umul128(a, b, high);
+      #else
+         const uint64_t a0 = a & 0xFFFFFFFF, a1 = a >> 32;
+         const uint64_t b0 = b & 0xFFFFFFFF, b1 = b >> 32;
+         const uint64_t p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+         const uint64_t mid = (p00 >> 32) + (p01 & 0xFFFFFFFF) + (p10 & 0xFFFFFFFF);
+         *high = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+         return (mid << 32) | (p00 & 0xFFFFFFFF);
+      #endif
+   }
+
+   /**
+    * Miller-Rabin with the bases that decide every n < 2^64
+    **/
+   static bool is_prime(uint64_t n) noexcept
+   {
+      static const uint64_t bases[] = { 2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37 };
+
+      if (n < 2)
+      {
+         return false;
+      }
+      for (const auto base : bases)
+      {
+         if (n % base == 0)
+         {
+            return n == base;
+         }
+      }
+
+      unsigned s = 0;
+      uint64_t d = n - 1;
+      for (; (d & 1) == 0; d >>= 1)
+      {
+         ++s;
+      }
+
+      const montgomery_t mod(n);
+      const uint64_t minus_one = n - mod.one;
+      for (const auto base : bases)
+      {
+         uint64_t x = mod.pow(mod.to(base), d);
+         if ((x == mod.one) || (x == minus_one))
+         {
+            continue;
+         }
+         unsigned i = 1;
+         for (; i < s; ++i)
+         {
+            x = mod.mul(x, x);
+            if (x == minus_one)
+            {
+               break;
+            }
+         }
+         if (i == s)
+         {
+            return false;
+         }
+      }
+      return true;
+   }
+
+   /**
+    * Distinct prime factors of n, by trial division until what is left
+    * is prime
+    **/
+   static std::vector<uint64_t> prime_factors(uint64_t n)
+   {
+      std::vector<uint64_t> factors;
+      bool is_left_prime = is_prime(n);
+      for (uint64_t f = 2; !is_left_prime && (f * f <= n); f += (f == 2) ? 1 : 2)
+      {
+         if (n % f == 0)
+         {
+            factors.push_back(f);
+            do
+            {
+               n /= f;
+            } while (n % f == 0);
+            is_left_prime = is_prime(n);
+         }
+      }
+      if (n > 1)
+      {
+         factors.push_back(n);
+      }
+      return factors;
+   }
+};
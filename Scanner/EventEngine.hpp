@@ -0,0 +1,190 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include "ConnSocket.hpp"
+#ifdef __linux__
+   #include <sys/epoll.h>
+#endif
+
+/**
+ * Readiness notification for the sockets of one scanner thread.
+ *
+ * Every socket is registered with the index of the slot that owns it, and
+ * wait() only calls back for the slots that have something to process. On
+ * Linux this is an edge-triggered epoll set, so the cost of a wait is
+ * proportional to the number of ready sockets, not to the number of sockets
+ * in flight. Everywhere else it falls back to a poll() over all slots.
+ **/
+class EventEngine
+{
+public:
+   enum class Backend_e
+   {
+      Poll,
+      Epoll,
+   };
+
+   #ifdef __linux__
+      static constexpr Backend_e default_backend = Backend_e::Epoll;
+   #else
+      static constexpr Backend_e default_backend = Backend_e::Poll;
+   #endif
+
+   EventEngine(const EventEngine&) = delete;
+   EventEngine& operator=(const EventEngine&) = delete;
+
+   EventEngine(size_t capacity, Backend_e backend = default_backend) :
+      m_backend(backend)
+   {
+      #ifdef __linux__
+         if (m_backend == Backend_e::Epoll)
+         {
+            m_epfd = epoll_create1(EPOLL_CLOEXEC);
+            if (m_epfd < 0)
+            {
+               throw std::system_error(errno, std::generic_category(), "epoll_create1");
+            }
+            m_events.resize(capacity ? capacity : 1);
+            return;
+         }
+      #endif
+
+      m_backend = Backend_e::Poll;
+      m_fdas.resize(capacity, { INVALID_SOCKET, 0, 0 });
+   }
+
+   ~EventEngine()
+   {
+      #ifdef __linux__
+         if (m_epfd >= 0)
+         {
+            close(m_epfd);
+         }
+      #endif
+   }
+
+   Backend_e backend() const noexcept
+   {
+      return m_backend;
+   }
+
+   /**
+    * Registers the socket in fda.fd as belonging to slot
+    **/
+   bool watch(size_t slot, const pollfd& fda) noexcept
+   {
+      #ifdef __linux__
+         if (m_backend == Backend_e::Epoll)
+         {
+            // Interest in both directions is registered once, so that state changes
+            // in the socket never need an epoll_ctl call
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLET;
+            ev.data.u64 = slot;
+            if (epoll_ctl(m_epfd, EPOLL_CTL_ADD, fda.fd, &ev) != 0)
+            {
+               printf("epoll_ctl error - Error=%d\n", errno);
+               return false;
+            }
+            return true;
+         }
+      #endif
+
+      m_fdas[slot] = fda;
+      m_poll_count = std::max(m_poll_count, slot + 1);
+      return true;
+   }
+
+   /**
+    * The socket in slot changed the events it is waiting for
+    **/
+   void update_events(size_t slot, const pollfd& fda) noexcept
+   {
+      if (m_backend == Backend_e::Poll)
+      {
+         m_fdas[slot].events = fda.events;
+      }
+   }
+
+   /**
+    * The socket in slot is about to be closed. Closing the descriptor is
+    * enough to remove it from an epoll set.
+    **/
+   void unwatch(size_t slot) noexcept
+   {
+      if (m_backend == Backend_e::Poll)
+      {
+         m_fdas[slot] = { INVALID_SOCKET, 0, 0 };
+         while ((m_poll_count > 0) && (m_fdas[m_poll_count - 1].fd == INVALID_SOCKET))
+         {
+            --m_poll_count;
+         }
+      }
+   }
+
+   /**
+    * Waits up to timeout ms for socket events and calls on_ready(slot, revents)
+    * for every slot that was signaled. revents uses the POLL* flags.
+    *
+    * Returns the number of signaled slots or -1 on error.
+    **/
+   template<typename Func>
+   int wait(int timeout, Func&& on_ready)
+   {
+      #ifdef __linux__
+         if (m_backend == Backend_e::Epoll)
+         {
+            const int ret = epoll_wait(m_epfd, m_events.data(), static_cast<int>(m_events.size()), timeout);
+            if (ret < 0)
+            {
+               return (errno == EINTR) ? 0 : -1;
+            }
+
+            for (int i = 0; i < ret; ++i)
+            {
+               on_ready(static_cast<size_t>(m_events[i].data.u64), to_revents(m_events[i].events));
+            }
+            return ret;
+         }
+      #endif
+
+      // Only up to the highest slot in use. SlotTable hands out the lowest
+      // free slot, so this stays close to the number of sockets in flight
+      const int ret = poll(m_fdas.data(), static_cast<unsigned long>(m_poll_count), timeout);
+      if (ret <= 0)
+      {
+         return ret;
+      }
+
+      for (size_t i = 0; i < m_poll_count; ++i)
+      {
+         if (m_fdas[i].revents != 0)
+         {
+            const short revents = m_fdas[i].revents;
+            m_fdas[i].revents = 0;
+            on_ready(i, revents);
+         }
+      }
+      return ret;
+   }
+
+private:
+   Backend_e m_backend;
+   std::vector<pollfd> m_fdas;
+   size_t m_poll_count = 0;
+
+   #ifdef __linux__
+      int m_epfd = -1;
+      std::vector<epoll_event> m_events;
+
+      static short to_revents(uint32_t events) noexcept
+      {
+         short revents = 0;
+         if (events & EPOLLIN)    revents |= POLLIN;
+         if (events & EPOLLOUT)   revents |= POLLOUT;
+         if (events & EPOLLERR)   revents |= POLLERR;
+         if (events & EPOLLHUP)   revents |= POLLHUP;
+         return revents;
+      }
+   #endif
+};
@@ -1,15 +1,58 @@
 #pragma once
+#include <cstdio>
 #include <cstdlib>
+#include <cstdint>
+#include <array>
+#include <atomic>
+#include <memory>
 #include <vector>
 #include <algorithm>
 #include <cassert>
+#include <fstream>
 #include <tuple>
+#include <utility>
 #include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#ifdef _WIN32
+   #include <WS2tcpip.h>
+#else
+   #include <arpa/inet.h>
+#endif
 #include "rand-blackrock.h"
+#include "CyclicGroup.hpp"
+#include "RangeIndex.hpp"
 
+/**
+ * One address to probe. ip is in host byte order.
+ **/
+struct target_t
+{
+   unsigned long  ip;
+   unsigned short port;
+};
+
+/**
+ * Sweeps address ranges in a random order. Ranges are added and excluded
+ * first, then build() lays out the sweep once, before any target is taken.
+ **/
 class IPSpaceSweeper
 {
 public:
+   /**
+    * How the targets are shuffled. BlackRock is a Feistel cipher over the
+    * exact range, whose cycle walking takes a variable number of rounds
+    * per target. CyclicGroup steps through a multiplicative group mod a
+    * prime just above the range, for the same cost on every target.
+    * Both visit every target exactly once.
+    **/
+   enum class Order_e
+   {
+      BlackRock,
+      CyclicGroup,
+   };
+
    IPSpaceSweeper() : 
       rand_gen(std::random_device()()),
       rand_blackrock()
@@ -18,9 +61,22 @@ public:
    IPSpaceSweeper(const IPSpaceSweeper& rhs) :
       rand_gen(rhs.rand_gen),
       rand_blackrock(rhs.rand_blackrock),
+      m_order(rhs.m_order),
+      m_cycle(rhs.m_cycle),
+      m_cycle_cursor(rhs.m_cycle_cursor),
       m_counter(rhs.m_counter),
       m_total_range_length(rhs.m_total_range_length),
-      m_ipSpaceToSweep(rhs.m_ipSpaceToSweep)
+      m_num_of_targets(rhs.m_num_of_targets),
+      m_ipSpaceToSweep(rhs.m_ipSpaceToSweep),
+      m_excluded(rhs.m_excluded),
+      m_index(rhs.m_index),
+      m_ports(rhs.m_ports),
+      m_cursor(rhs.m_cursor),
+      m_chunk_size(rhs.m_chunk_size),
+      m_chunk_end(rhs.m_chunk_end),
+      m_batch(rhs.m_batch),
+      m_batch_pos(rhs.m_batch_pos),
+      m_batch_end(rhs.m_batch_end)
    {}
 
    void add_range(const char* addr, unsigned char mask)
@@ -28,49 +84,274 @@ public:
       add_range(inet_addr(addr), mask);
    }
 
-   void add_range(unsigned long ip, unsigned char mask)
+   /**
+    * Adds a prefix to the sweep. ip is in network byte order and must have
+    * no bit set past the mask. Overlapping and adjacent ranges are merged by
+    * build(), so they can be added in any order.
+    **/
+   bool add_range(unsigned long ip, unsigned char mask)
+   {
+      if (mask > 32)
+      {
+         printf("Invalid mask %u\n", mask);
+         return false;
+      }
+      if (!is_network_address(ip, mask))
+      {
+         printf("Invalid address for mask %lu.%lu.%lu.%lu/%u\n", ip & 0x000000FF, (ip & 0x0000FF00) >> 8, (ip & 0x00FF0000) >> 16, (ip & 0xFF000000) >> 24, mask);
+         return false;
+      }
+      m_ipSpaceToSweep.push_back(make_range(ip, mask));
+      return true;
+   }
+
+   void exclude_range(const char* addr, unsigned char mask)
    {
-      //TODO: Remove private addresses
-      // According to RFC1918 [https://tools.ietf.org/html/rfc1918]:
-      //   10.0.0.0    - 10.0.0.0    / 8
-      //   172.16.0.0  - 172.16.0.0  / 12
-      //   192.168.0.0 - 192.168.0.0 / 16
-      printf("%lu.%lu.%lu.%lu/%u  =>  ", ip & 0x000000FF, (ip & 0x0000FF00) >> 8, (ip & 0x00FF0000) >> 16, (ip & 0xFF000000) >> 24, mask);
+      exclude_range(inet_addr(addr), mask);
+   }
 
+   /**
+    * Leaves the whole prefix out of the sweep, from every range added before
+    * or after. ip is in network byte order, like for add_range().
+    **/
+   void exclude_range(unsigned long ip, unsigned char mask)
+   {
       if (mask > 32)
       {
-         printf("Invalid mask\n");
+         printf("Invalid mask to exclude: %u\n", mask);
          return;
       }
 
-      const unsigned long ip_mask = (mask) ? (static_cast<signed long>(0x80000000) >> (mask-1)) : 0;
-      ip = ntohl(ip);
+      const uint32_t ip_mask = (mask) ? (0xFFFFFFFFu << (32 - mask)) : 0;
+      const uint32_t first = static_cast<uint32_t>(ntohl(ip)) & ip_mask;
+      m_excluded.emplace_back(first, first | ~ip_mask);
+   }
+
+   /**
+    * Leaves out the special-purpose blocks of RFC 6890 that can never be a
+    * public server: private (RFC 1918), shared (RFC 6598), loopback,
+    * link-local, documentation, benchmarking, multicast and reserved
+    **/
+   void exclude_reserved_ranges()
+   {
+      static const std::pair<const char*, unsigned char> reserved[] = {
+         { "0.0.0.0", 8 },
+         { "10.0.0.0", 8 },
+         { "100.64.0.0", 10 },
+         { "127.0.0.0", 8 },
+         { "169.254.0.0", 16 },
+         { "172.16.0.0", 12 },
+         { "192.0.0.0", 24 },
+         { "192.0.2.0", 24 },
+         { "192.168.0.0", 16 },
+         { "198.18.0.0", 15 },
+         { "198.51.100.0", 24 },
+         { "203.0.113.0", 24 },
+         { "224.0.0.0", 4 },
+         { "240.0.0.0", 4 },
+      };
 
-      if (ip & ~ip_mask)
+      for (const auto& it : reserved)
       {
-         printf("Invalid address for mask\n");
-         return;
+         exclude_range(it.first, it.second);
+      }
+   }
+
+   /**
+    * Adds every prefix listed in a file to the sweep, or with exclude leaves
+    * them out of it. Each line holds an a.b.c.d/n, optionally followed by
+    * other fields like an origin AS, and # starts a comment. Nothing is
+    * sorted or shuffled here: build() does it once for all of them.
+    * Returns the number of prefixes read.
+    **/
+   size_t load_ranges(const std::string& path, bool exclude)
+   {
+      std::ifstream file(path);
+      if (!file)
+      {
+         throw std::runtime_error("Cannot open '" + path + "'");
       }
 
-      unsigned long range_size = (~ip_mask) - 1;
-      printf("range_size = %lu\n", range_size);
+      // Whole lines, however long: a BGP dump may list dozens of AS numbers
+      // after the prefix
+      size_t num_of_prefixes = 0;
+      size_t line_number = 0;
+      std::string line;
+      while (std::getline(file, line))
+      {
+         ++line_number;
 
-      m_total_range_length += range_size;
+         // First field of the line, if any
+         std::string_view field(line);
+         field = field.substr(0, field.find('#'));
+         const auto begin = field.find_first_not_of(" \t\r\n");
+         if (begin == std::string_view::npos)
+         {
+            continue;
+         }
+         field = field.substr(begin);
+         field = field.substr(0, field.find_first_of(" \t\r\n,;"));
 
-      m_ipSpaceToSweep.emplace_back((ip + 1), (ip + range_size));
+         unsigned long ip;
+         unsigned char mask;
+         if (!parse_cidr(field, &ip, &mask) || (!exclude && !is_network_address(ip, mask)))
+         {
+            throw std::runtime_error("Invalid prefix '" + std::string(field) + "' in " + path + ":" + std::to_string(line_number));
+         }
 
-      std::sort(m_ipSpaceToSweep.begin(), m_ipSpaceToSweep.end(), [](const range_t& a, const range_t& b) {
-            return a.begin < b.begin;
-         });
+         if (exclude)
+         {
+            exclude_range(ip, mask);
+         }
+         else
+         {
+            m_ipSpaceToSweep.push_back(make_range(ip, mask));
+         }
+         ++num_of_prefixes;
+      }
+      return num_of_prefixes;
+   }
+
+   /**
+    * Parses "a.b.c.d/n" in dotted decimal ("a.b.c.d" alone is a /32). ip is
+    * in network byte order.
+    **/
+   static bool parse_cidr(std::string_view cidr, unsigned long* ip, unsigned char* mask)
+   {
+      const auto slash = cidr.find('/');
+      const auto addr = cidr.substr(0, slash);
+      char addr_str[16];
+      if (addr.size() >= sizeof(addr_str))
+      {
+         return false;
+      }
+      addr.copy(addr_str, addr.size());
+      addr_str[addr.size()] = '\0';
+
+      // Four decimal parts only: inet_addr would also take octal, hex and
+      // shorthand forms, reading 010.0.0.0 as 8.0.0.0 and 65001 as 0.0.253.233
+      in_addr in;
+      if (inet_pton(AF_INET, addr_str, &in) != 1)
+      {
+         return false;
+      }
+      *ip = in.s_addr;
+
+      *mask = 32;
+      if (slash != std::string_view::npos)
+      {
+         const auto bits = cidr.substr(slash + 1);
+         if (bits.empty() || (bits.size() > 2))
+         {
+            return false;
+         }
+         unsigned value = 0;
+         for (const char c : bits)
+         {
+            if ((c < '0') || (c > '9'))
+            {
+               return false;
+            }
+            value = 10 * value + (c - '0');
+         }
+         if (value > 32)
+         {
+            return false;
+         }
+         *mask = static_cast<unsigned char>(value);
+      }
+      return true;
+   }
+
+   /**
+    * Ports probed on every address. Each address and port pair is a target
+    * of its own, so the ports of an address are spread over the sweep too.
+    **/
+   void set_ports(std::vector<unsigned short> ports)
+   {
+      if (ports.empty())
+      {
+         ports.push_back(default_port);
+      }
+      m_ports = std::move(ports);
+   }
 
-      rand_blackrock = BlackRock(m_total_range_length, rand_gen(), 4);
+   /**
+    * Order of the sweep, used from the next build() on
+    **/
+   void set_order(Order_e order) noexcept
+   {
+      m_order = order;
+   }
+
+   /**
+    * Subtracts the excluded prefixes from the ranges and sets up the random
+    * order of the sweep. Nothing is looked up per address while sweeping:
+    * only allowed addresses are in the index space.
+    **/
+   void build()
+   {
+      // Excluded prefixes merged into disjoint ranges, in order
+      coalesce(m_excluded);
+
+      // Ranges of an earlier build are kept, exclusions apply to them again.
+      // Overlapping ones are merged, else their addresses would be swept
+      // more than once
+      std::vector<range_t> ranges = std::move(m_ipSpaceToSweep);
+      m_ipSpaceToSweep.clear();
+      if (m_index)
+      {
+         ranges.insert(ranges.end(), m_index->get_ranges().begin(), m_index->get_ranges().end());
+      }
+      coalesce(ranges);
+
+      std::vector<range_t> allowed;
+      allowed.reserve(ranges.size());
+      for (const auto& it : ranges)
+      {
+         // First exclusion that does not end before this range
+         auto ex = std::lower_bound(m_excluded.begin(), m_excluded.end(), it.begin, [](const range_t& a, uint32_t begin) {
+               return a.end < begin;
+            });
+
+         uint64_t begin = it.begin;
+         for (; (ex != m_excluded.end()) && (ex->begin <= it.end); ++ex)
+         {
+            if (ex->begin > begin)
+            {
+               allowed.emplace_back(static_cast<uint32_t>(begin), ex->begin - 1);
+            }
+            begin = static_cast<uint64_t>(ex->end) + 1;
+         }
+         if (begin <= it.end)
+         {
+            allowed.emplace_back(static_cast<uint32_t>(begin), it.end);
+         }
+      }
+      m_index = std::make_shared<const RangeIndex>(std::move(allowed));
+
+      m_counter = 0;
+      m_num_of_targets = m_index->get_num_of_ips() * m_ports.size();
+      m_total_range_length = m_num_of_targets;
+      m_cycle_cursor = CyclicGroup::cursor_t();
+
+      // Neither order can shuffle an empty range
+      if ((m_num_of_targets > 0) && (m_order == Order_e::CyclicGroup))
+      {
+         m_cycle = CyclicGroup(m_num_of_targets, rand_gen());
+         m_total_range_length = m_cycle.get_length();
+      }
+      else if (m_num_of_targets > 0)
+      {
+         rand_blackrock = BlackRock(m_num_of_targets, rand_gen(), 4);
+      }
    }
 
    IPSpaceSweeper get_slice(size_t num_of_slices, size_t index)
    {
       IPSpaceSweeper slice(*this);
 
-      const size_t slice_size = m_total_range_length / num_of_slices;
+      const uint64_t slice_size = m_total_range_length / num_of_slices;
 
       slice.m_counter = index * slice_size;
 
@@ -79,54 +360,217 @@ public:
          slice.m_total_range_length = slice.m_counter + slice_size;
       }
 
-      printf("Slice %zd of %zd - begin=%u  end=%u\n", index, num_of_slices, slice.m_counter, slice.m_total_range_length);
+      printf("Slice %zd of %zd - begin=%llu  end=%llu\n", index, num_of_slices,
+         static_cast<unsigned long long>(slice.m_counter), static_cast<unsigned long long>(slice.m_total_range_length));
 
       return slice;
    }
 
+   /**
+    * Makes this sweeper and every copy made from it take their indices from
+    * one shared cursor, chunk_size at a time, instead of each sweeping a
+    * fixed slice. A thread that is slowed down by its targets then simply
+    * takes fewer chunks, and all threads run out of targets together.
+    * Must come after build().
+    **/
+   void share_in_chunks(size_t chunk_size)
+   {
+      m_cursor = std::make_shared<std::atomic<uint64_t>>(m_counter);
+      m_chunk_size = std::max<uint64_t>(chunk_size, 1);
+      m_chunk_end = m_counter;
+   }
+
    bool has_range_finished() const noexcept
    {
+      if (m_batch_pos < m_batch_end)
+      {
+         return false;
+      }
+      else if (m_cursor)
+      {
+         return (m_counter >= m_chunk_end) && (m_cursor->load(std::memory_order_relaxed) >= m_total_range_length);
+      }
       return m_counter >= m_total_range_length;
    }
 
-   unsigned long get_ip() noexcept
+   /**
+    * Next target of the sweep. Returns false once the range has finished.
+    * Targets are made batch_size at a time, so most calls just copy one.
+    **/
+   bool try_get(target_t* target) noexcept
    {
-      const auto val = rand_blackrock.shuffle(m_counter++);
-      const auto ret = range_lookup(static_cast<unsigned long>(val));
-      return ret;
+      if ((m_batch_pos == m_batch_end) && !fill_batch())
+      {
+         return false;
+      }
+
+      *target = m_batch[m_batch_pos++];
+      return true;
    }
 
-   std::tuple<unsigned long, unsigned long> get_stats() const noexcept
+   /**
+    * Disjoint address ranges in the sweep, after build()
+    **/
+   size_t get_num_of_ranges() const noexcept
    {
-      return std::make_tuple(m_counter, m_total_range_length);
+      return m_index ? m_index->get_ranges().size() : 0;
    }
-   
-private:
-   struct range_t
+
+   /**
+    * Targets taken and targets in the sweep, in address and port pairs
+    **/
+   std::tuple<uint64_t, uint64_t> get_stats() const noexcept
    {
-      range_t(unsigned long b, unsigned long e) : begin(b), end(e) {}
-      unsigned long begin;
-      unsigned long end;
-   };
+      // The cycle has a few more positions than targets
+      const uint64_t taken = m_counter - (m_batch_end - m_batch_pos);
+      return std::make_tuple(std::min(taken, m_num_of_targets), m_num_of_targets);
+   }
    
+private:
+   static constexpr unsigned short default_port = 443;
+   static constexpr size_t batch_size = 64;
+
+   using range_t = RangeIndex::range_t;
+
    std::mt19937_64 rand_gen;
    BlackRock rand_blackrock;
-   unsigned long m_counter = 0;
-   unsigned long m_total_range_length = 0;
-   std::vector<range_t> m_ipSpaceToSweep;
+   Order_e m_order = Order_e::BlackRock;
+   CyclicGroup m_cycle;
+   CyclicGroup::cursor_t m_cycle_cursor;   // Where this copy is in m_cycle
+   uint64_t m_counter = 0;
+   uint64_t m_total_range_length = 0;   // Positions in the order of the sweep
+   uint64_t m_num_of_targets = 0;       // Addresses times ports
+   std::vector<range_t> m_ipSpaceToSweep;   // Added since the last build()
+   std::vector<range_t> m_excluded;
+   std::shared_ptr<const RangeIndex> m_index;
+   std::vector<unsigned short> m_ports{ default_port };
 
-   unsigned long range_lookup(unsigned long index) const noexcept
+   // Shared sweep: the next index no copy has taken yet, and the end of the
+   // chunk this copy is on
+   std::shared_ptr<std::atomic<uint64_t>> m_cursor;
+   uint64_t m_chunk_size = 0;
+   uint64_t m_chunk_end = 0;
+
+   // Targets made ahead, and the next one to hand out
+   std::array<target_t, batch_size> m_batch;
+   size_t m_batch_pos = 0;
+   size_t m_batch_end = 0;
+
+   static bool is_network_address(unsigned long ip, unsigned char mask) noexcept
    {
-      for (const auto& it : m_ipSpaceToSweep)
+      const uint32_t ip_mask = (mask) ? (0xFFFFFFFFu << (32 - mask)) : 0;
+      return (static_cast<uint32_t>(ntohl(ip)) & ~ip_mask) == 0;
+   }
+
+   /**
+    * Addresses of a prefix to sweep. The network and broadcast addresses
+    * are left out, except in /31 and /32 where there are none
+    **/
+   static range_t make_range(unsigned long ip, unsigned char mask) noexcept
+   {
+      const uint32_t ip_mask = (mask) ? (0xFFFFFFFFu << (32 - mask)) : 0;
+      const uint32_t first = static_cast<uint32_t>(ntohl(ip));
+      const uint32_t last = first | ~ip_mask;
+      return (mask < 31) ? range_t(first + 1, last - 1) : range_t(first, last);
+   }
+
+   /**
+    * Sorts ranges and merges the ones that overlap or touch
+    **/
+   static void coalesce(std::vector<range_t>& ranges)
+   {
+      std::sort(ranges.begin(), ranges.end(), [](const range_t& a, const range_t& b) {
+            return a.begin < b.begin;
+         });
+
+      size_t merged = 0;
+      for (size_t i = 0; i < ranges.size(); ++i)
       {
-         const unsigned long range_len = it.end - it.begin + 1;
-         if (index < range_len)
-            return it.begin + index;
+         if ((merged > 0) && (static_cast<uint64_t>(ranges[merged - 1].end) + 1 >= ranges[i].begin))
+         {
+            ranges[merged - 1].end = std::max(ranges[merged - 1].end, ranges[i].end);
+         }
          else
-            index -= range_len;
+         {
+            ranges[merged++] = ranges[i];
+         }
       }
+      ranges.erase(ranges.begin() + merged, ranges.end());
+   }
+
+   /**
+    * Makes the next batch of targets: shuffles their indices, then looks up
+    * all their addresses at once
+    **/
+   bool fill_batch() noexcept
+   {
+      uint64_t index[batch_size];
+      size_t count = 0;
+
+      // Positions of the cycle past the range give no target, so a batch
+      // of them can come out empty
+      while (count == 0)
+      {
+         if (m_cursor && (m_counter >= m_chunk_end) && !take_chunk())
+         {
+            return false;
+         }
+
+         const uint64_t end = m_cursor ? m_chunk_end : m_total_range_length;
+         if (m_counter >= end)
+         {
+            return false;
+         }
+
+         const size_t positions = static_cast<size_t>(std::min<uint64_t>(batch_size, end - m_counter));
+         if (m_order == Order_e::CyclicGroup)
+         {
+            count = m_cycle.permute_n(m_cycle_cursor, m_counter, positions, index);
+         }
+         else
+         {
+            rand_blackrock.shuffle_n(m_counter, positions, index);
+            count = positions;
+         }
+         m_counter += positions;
+      }
+
+      // Consecutive indices of the product space are the ports of one
+      // address, but the shuffle scatters them
+      unsigned long ip[batch_size];
+      const size_t num_of_ports = m_ports.size();
+      for (size_t i = 0; i < count; ++i)
+      {
+         m_batch[i].port = m_ports[index[i] % num_of_ports];
+         index[i] /= num_of_ports;
+      }
+      m_index->lookup_n(index, count, ip);
+      for (size_t i = 0; i < count; ++i)
+      {
+         m_batch[i].ip = ip[i];
+      }
+
+      m_batch_pos = 0;
+      m_batch_end = count;
+      return true;
+   }
+
+   bool take_chunk() noexcept
+   {
+      // Never moved past the end, where it could wrap around
+      uint64_t begin = m_cursor->load(std::memory_order_relaxed);
+      uint64_t end;
+      do
+      {
+         if (begin >= m_total_range_length)
+         {
+            return false;
+         }
+         end = begin + std::min(m_chunk_size, m_total_range_length - begin);
+      } while (!m_cursor->compare_exchange_weak(begin, end, std::memory_order_relaxed));
 
-      assert(false);
-      return 0;
+      m_counter = begin;
+      m_chunk_end = end;
+      return true;
    }
 };
\ No newline at end of file
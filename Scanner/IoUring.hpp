@@ -0,0 +1,322 @@
+#pragma once
+#ifdef __linux__
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <system_error>
+#include <linux/io_uring.h>
+#include <linux/time_types.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+/**
+ * Minimal io_uring wrapper over the raw syscalls, so the scanner does not
+ * need liburing.
+ *
+ * Submissions are queued with the prep_* functions and only reach the kernel
+ * on submit(), so a whole loop iteration worth of connects, sends and recvs
+ * costs a single io_uring_enter.
+ **/
+class IoUring
+{
+public:
+   static constexpr __u64 timeout_user_data = ~0ULL;
+   static constexpr __u64 ignore_user_data  = ~0ULL - 1;
+
+   IoUring(const IoUring&) = delete;
+   IoUring& operator=(const IoUring&) = delete;
+
+   /**
+    * @param entries
+    *      Size of the submission queue.
+    * @param max_inflight
+    *      Maximum number of operations in flight at once. The completion queue
+    *      is sized so it can hold all of their results, up to the limit of the
+    *      kernel; past it, results that do not fit wait in the kernel.
+    */
+   IoUring(unsigned entries, unsigned max_inflight)
+   {
+      io_uring_params params;
+      memset(&params, 0, sizeof(params));
+      params.flags = IORING_SETUP_CQSIZE | IORING_SETUP_CLAMP;
+      params.cq_entries = max_inflight;
+
+      m_fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &params));
+      if (m_fd < 0)
+      {
+         throw std::system_error(errno, std::generic_category(), "io_uring_setup");
+      }
+
+      m_sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(__u32);
+      m_cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      const bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP);
+      if (single_mmap)
+      {
+         m_sq_ring_size = m_cq_ring_size = std::max(m_sq_ring_size, m_cq_ring_size);
+      }
+
+      m_sq_ring = mmap(nullptr, m_sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQ_RING);
+      if (m_sq_ring == MAP_FAILED)
+      {
+         const auto err = errno;
+         close(m_fd);
+         throw std::system_error(err, std::generic_category(), "mmap(sq ring)");
+      }
+
+      if (single_mmap)
+      {
+         m_cq_ring = m_sq_ring;
+      }
+      else
+      {
+         m_cq_ring = mmap(nullptr, m_cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_CQ_RING);
+         if (m_cq_ring == MAP_FAILED)
+         {
+            const auto err = errno;
+            munmap(m_sq_ring, m_sq_ring_size);
+            close(m_fd);
+            throw std::system_error(err, std::generic_category(), "mmap(cq ring)");
+         }
+      }
+
+      m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      m_sqes = static_cast<io_uring_sqe*>(mmap(nullptr, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_fd, IORING_OFF_SQES));
+      if (m_sqes == MAP_FAILED)
+      {
+         const auto err = errno;
+         if (!single_mmap)
+         {
+            munmap(m_cq_ring, m_cq_ring_size);
+         }
+         munmap(m_sq_ring, m_sq_ring_size);
+         close(m_fd);
+         throw std::system_error(err, std::generic_category(), "mmap(sqes)");
+      }
+
+      auto sq = static_cast<uint8_t*>(m_sq_ring);
+      m_sq_head    = reinterpret_cast<__u32*>(sq + params.sq_off.head);
+      m_sq_tail    = reinterpret_cast<__u32*>(sq + params.sq_off.tail);
+      m_sq_mask    = *reinterpret_cast<__u32*>(sq + params.sq_off.ring_mask);
+      m_sq_entries = *reinterpret_cast<__u32*>(sq + params.sq_off.ring_entries);
+
+      // SQEs are always consumed in order, so the index array is the identity
+      auto sq_array = reinterpret_cast<__u32*>(sq + params.sq_off.array);
+      for (__u32 i = 0; i < m_sq_entries; ++i)
+      {
+         sq_array[i] = i;
+      }
+
+      auto cq = static_cast<uint8_t*>(m_cq_ring);
+      m_cq_head = reinterpret_cast<__u32*>(cq + params.cq_off.head);
+      m_cq_tail = reinterpret_cast<__u32*>(cq + params.cq_off.tail);
+      m_cq_mask = *reinterpret_cast<__u32*>(cq + params.cq_off.ring_mask);
+      m_cqes    = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+
+      m_local_tail = *m_sq_tail;
+      m_features = params.features;
+   }
+
+   ~IoUring()
+   {
+      munmap(m_sqes, m_sqes_size);
+      if (m_cq_ring != m_sq_ring)
+      {
+         munmap(m_cq_ring, m_cq_ring_size);
+      }
+      munmap(m_sq_ring, m_sq_ring_size);
+      close(m_fd);
+   }
+
+   bool prep_connect(int fd, const sockaddr* addr, socklen_t addrlen, __u64 user_data) noexcept
+   {
+      auto sqe = get_sqe();
+      if (!sqe) return false;
+      sqe->opcode = IORING_OP_CONNECT;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<__u64>(addr);
+      sqe->off = addrlen;
+      sqe->user_data = user_data;
+      return true;
+   }
+
+   bool prep_send(int fd, const void* buf, unsigned len, __u64 user_data) noexcept
+   {
+      auto sqe = get_sqe();
+      if (!sqe) return false;
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<__u64>(buf);
+      sqe->len = len;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = user_data;
+      return true;
+   }
+
+   bool prep_recv(int fd, void* buf, unsigned len, __u64 user_data) noexcept
+   {
+      auto sqe = get_sqe();
+      if (!sqe) return false;
+      sqe->opcode = IORING_OP_RECV;
+      sqe->fd = fd;
+      sqe->addr = reinterpret_cast<__u64>(buf);
+      sqe->len = len;
+      sqe->user_data = user_data;
+      return true;
+   }
+
+   /**
+    * Cancels the operation that was submitted with target_user_data. The target
+    * still completes (usually with -ECANCELED) and must be reaped as usual.
+    **/
+   bool prep_cancel(__u64 target_user_data) noexcept
+   {
+      auto sqe = get_sqe();
+      if (!sqe) return false;
+      sqe->opcode = IORING_OP_ASYNC_CANCEL;
+      sqe->fd = -1;
+      sqe->addr = target_user_data;
+      sqe->user_data = ignore_user_data;
+      return true;
+   }
+
+   /**
+    * Submits everything queued so far and waits until at least one completion is
+    * available or timeout ms have elapsed.
+    *
+    * Returns the number of submitted entries or -errno.
+    **/
+   int submit_and_wait(int timeout) noexcept
+   {
+      m_ts.tv_sec = timeout / 1000;
+      m_ts.tv_nsec = (timeout % 1000) * 1000000LL;
+
+      if (m_features & IORING_FEAT_EXT_ARG)
+      {
+         io_uring_getevents_arg arg;
+         memset(&arg, 0, sizeof(arg));
+         arg.ts = reinterpret_cast<__u64>(&m_ts);
+         const int ret = enter(1, IORING_ENTER_EXT_ARG, &arg, sizeof(arg));
+         return (ret == -ETIME) ? 0 : ret;
+      }
+
+      // Older kernels can only time out the wait with a timeout operation. Only
+      // one is kept in flight, so a wait may end up shorter than timeout
+      if (!m_timeout_armed)
+      {
+         auto sqe = get_sqe();
+         if (sqe)
+         {
+            sqe->opcode = IORING_OP_TIMEOUT;
+            sqe->fd = -1;
+            sqe->addr = reinterpret_cast<__u64>(&m_ts);
+            sqe->len = 1;
+            sqe->user_data = timeout_user_data;
+            m_timeout_armed = true;
+         }
+      }
+
+      return enter(1);
+   }
+
+   /**
+    * Hands the queued entries to the kernel without waiting for anything.
+    **/
+   int submit() noexcept
+   {
+      return enter(0);
+   }
+
+   /**
+    * Calls on_complete(user_data, res) for every available completion
+    **/
+   template<typename Func>
+   unsigned for_each_completion(Func&& on_complete)
+   {
+      __u32 head = *m_cq_head;
+      const __u32 tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+      unsigned count = 0;
+      for (; head != tail; ++head, ++count)
+      {
+         const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+         if (cqe.user_data == timeout_user_data)
+         {
+            m_timeout_armed = false;
+         }
+         else if (cqe.user_data != ignore_user_data)
+         {
+            on_complete(cqe.user_data, cqe.res);
+         }
+      }
+      __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+      return count;
+   }
+
+   unsigned long long enter_calls() const noexcept
+   {
+      return m_enter_calls;
+   }
+
+private:
+   int m_fd = -1;
+   void* m_sq_ring = nullptr;
+   void* m_cq_ring = nullptr;
+   size_t m_sq_ring_size = 0;
+   size_t m_cq_ring_size = 0;
+   io_uring_sqe* m_sqes = nullptr;
+   size_t m_sqes_size = 0;
+
+   __u32* m_sq_head = nullptr;
+   __u32* m_sq_tail = nullptr;
+   __u32  m_sq_mask = 0;
+   __u32  m_sq_entries = 0;
+   __u32  m_local_tail = 0;
+
+   __u32* m_cq_head = nullptr;
+   __u32* m_cq_tail = nullptr;
+   __u32  m_cq_mask = 0;
+   io_uring_cqe* m_cqes = nullptr;
+
+   __kernel_timespec m_ts{};
+   bool m_timeout_armed = false;
+   __u32 m_features = 0;
+   unsigned long long m_enter_calls = 0;
+
+   io_uring_sqe* get_sqe() noexcept
+   {
+      if ((m_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE)) >= m_sq_entries)
+      {  // Full. Make room by handing what is queued to the kernel
+         if ((enter(0) < 0) || ((m_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE)) >= m_sq_entries))
+         {
+            return nullptr;
+         }
+      }
+
+      auto sqe = &m_sqes[m_local_tail & m_sq_mask];
+      memset(sqe, 0, sizeof(*sqe));
+      ++m_local_tail;
+      return sqe;
+   }
+
+   int enter(unsigned wait_nr, unsigned flags = 0, const void* arg = nullptr, size_t argsz = 0) noexcept
+   {
+      const __u32 to_submit = m_local_tail - __atomic_load_n(m_sq_head, __ATOMIC_ACQUIRE);
+      __atomic_store_n(m_sq_tail, m_local_tail, __ATOMIC_RELEASE);
+
+      if (wait_nr)
+      {
+         flags |= IORING_ENTER_GETEVENTS;
+      }
+
+      ++m_enter_calls;
+      const int ret = static_cast<int>(syscall(__NR_io_uring_enter, m_fd, to_submit, wait_nr, flags, arg, argsz));
+      if (ret < 0)
+      {
+         return (errno == EINTR) ? 0 : -errno;
+      }
+      return ret;
+   }
+};
+
+#endif
@@ -0,0 +1,218 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <cassert>
+#include <memory>
+#include <vector>
+#ifdef _MSC_VER
+   #include <intrin.h>
+#endif
+
+/**
+ * Maps an index of a sweep to its address in a list of ranges. Built once by
+ * IPSpaceSweeper::build() and shared, read only, by every copy of the
+ * sweeper.
+ *
+ * The first index of every range is kept in a prefix sum, laid out as an
+ * implicit binary tree in breadth-first (Eytzinger) order. A lookup walks
+ * down the tree with no branch to mispredict. The nodes take 32 bits and the
+ * tree starts on a cache line, so the 16 nodes four levels below node k,
+ * 16k to 16k+15, fill one line, which a step prefetches.
+ *
+ * The node a lookup ends on also keeps the offset from index to address, so
+ * it takes one more load. The levels that do not fit in the caches still
+ * cost about a miss each, so a lookup slows down as the ranges grow into
+ * the hundreds of thousands; lookup_n() overlaps the misses of several
+ * lookups. Benchmarks/RangeIndexBench.cpp measures it.
+ **/
+class RangeIndex
+{
+public:
+   struct range_t
+   {
+      range_t(uint32_t b, uint32_t e) : begin(b), end(e) {}
+      uint32_t begin;
+      uint32_t end;
+   };
+
+   explicit RangeIndex(std::vector<range_t> ranges) :
+      m_ranges(std::move(ranges)),
+      m_first_index(m_ranges.size()),
+      m_tree_storage(m_ranges.size() + 1 + cache_line / sizeof(uint32_t)),
+      m_tree_offset(m_ranges.size() + 1)
+   {
+      void* tree = m_tree_storage.data();
+      size_t space = m_tree_storage.size() * sizeof(uint32_t);
+      m_tree = static_cast<uint32_t*>(std::align(cache_line, (m_ranges.size() + 1) * sizeof(uint32_t), tree, space));
+
+      for (size_t i = 0; i < m_ranges.size(); ++i)
+      {
+         m_first_index[i] = m_num_of_ips;
+         m_num_of_ips += static_cast<uint64_t>(m_ranges[i].end) - m_ranges[i].begin + 1;
+      }
+      fill_tree(0, 1);
+
+      // Past the last node, an index is in the last range
+      if (!m_ranges.empty())
+      {
+         m_tree_offset[0] = offset_of(m_ranges.size() - 1);
+      }
+      while ((size_t(2) << m_full_levels) - 1 <= m_ranges.size())
+      {
+         ++m_full_levels;
+      }
+   }
+
+   // m_tree points into m_tree_storage
+   RangeIndex(const RangeIndex&) = delete;
+   RangeIndex& operator=(const RangeIndex&) = delete;
+
+   const std::vector<range_t>& get_ranges() const noexcept
+   {
+      return m_ranges;
+   }
+
+   uint64_t get_num_of_ips() const noexcept
+   {
+      return m_num_of_ips;
+   }
+
+   /**
+    * Address at index, which must be below get_num_of_ips()
+    **/
+   unsigned long lookup(uint64_t index) const noexcept
+   {
+      assert(index < m_num_of_ips);
+
+      // Ends one past the node of the first range that begins after index
+      const size_t n = m_ranges.size();
+      size_t k = 1;
+      while (k <= n)
+      {
+         #ifdef __GNUC__
+            __builtin_prefetch(m_tree + std::min(16 * k, n));
+         #endif
+         k = 2 * k + (m_tree[k] <= index);
+      }
+      return at_node(k, index);
+   }
+
+   /**
+    * lookup() of count indices. They walk down the tree side by side, so
+    * the cache misses of one overlap with those of the others.
+    **/
+   void lookup_n(const uint64_t* index, size_t count, unsigned long* ip) const noexcept
+   {
+      if (m_ranges.size() > cached_nodes)
+      {
+         descend_n<true>(index, count, ip);
+      }
+      else
+      {
+         descend_n<false>(index, count, ip);
+      }
+   }
+
+private:
+   static constexpr size_t lanes = 8;
+   static constexpr size_t cache_line = 64;
+
+   // Nodes of a tree that fits in the L1 cache, where a prefetch only costs
+   static constexpr size_t cached_nodes = 32 * 1024 / sizeof(uint32_t);
+
+   std::vector<range_t> m_ranges;
+   std::vector<uint64_t> m_first_index;   // Prefix sum, in range order
+
+   // The same from node 1 on, starting on a cache line of m_tree_storage.
+   // There are at most 2^32 addresses, so every first index fits in 32 bits
+   std::vector<uint32_t> m_tree_storage;
+   uint32_t* m_tree = nullptr;
+
+   // Address minus index, mod 2^32, in the range before that of every node
+   std::vector<uint32_t> m_tree_offset;
+   uint64_t m_num_of_ips = 0;
+   unsigned m_full_levels = 0;            // Levels of the tree with no node missing
+
+   /**
+    * lookup_n(), prefetching the nodes ahead or not
+    **/
+   template<bool prefetch>
+   void descend_n(const uint64_t* index, size_t count, unsigned long* ip) const noexcept
+   {
+      const size_t n = m_ranges.size();
+      for (size_t i = 0; i < count; i += lanes)
+      {
+         const size_t num_of_lanes = std::min(lanes, count - i);
+         size_t k[lanes];
+         std::fill(k, k + lanes, 1);
+
+         // Levels every lane goes through, then the partial last one
+         for (unsigned level = 0; level < m_full_levels; ++level)
+         {
+            for (size_t lane = 0; lane < num_of_lanes; ++lane)
+            {
+               #ifdef __GNUC__
+                  if (prefetch)
+                  {
+                     __builtin_prefetch(m_tree + std::min(16 * k[lane], n));
+                  }
+               #endif
+               k[lane] = 2 * k[lane] + (m_tree[k[lane]] <= index[i + lane]);
+            }
+         }
+         for (size_t lane = 0; lane < num_of_lanes; ++lane)
+         {
+            if (k[lane] <= n)
+            {
+               k[lane] = 2 * k[lane] + (m_tree[k[lane]] <= index[i + lane]);
+            }
+            ip[i + lane] = at_node(k[lane], index[i + lane]);
+         }
+      }
+   }
+
+   /**
+    * Fills the subtree at node k with ranges from i on, in order.
+    * Returns the range after the last one it took.
+    **/
+   size_t fill_tree(size_t i, size_t k) noexcept
+   {
+      if (k <= m_ranges.size())
+      {
+         i = fill_tree(i, 2 * k);
+         m_tree[k] = static_cast<uint32_t>(m_first_index[i]);
+         m_tree_offset[k] = (i > 0) ? offset_of(i - 1) : 0;
+         i = fill_tree(i + 1, 2 * k + 1);
+      }
+      return i;
+   }
+
+   /**
+    * Address of index, from the node one past the end of its descent
+    **/
+   unsigned long at_node(size_t k, uint64_t index) const noexcept
+   {
+      // Back to the node of the first range that begins after index
+      k >>= trailing_ones(k) + 1;
+
+      // The range of index is the one before, or the last one at node 0
+      return static_cast<uint32_t>(index) + m_tree_offset[k];
+   }
+
+   uint32_t offset_of(size_t range) const noexcept
+   {
+      return m_ranges[range].begin - static_cast<uint32_t>(m_first_index[range]);
+   }
+
+   static unsigned trailing_ones(size_t k) noexcept
+   {
+      #ifdef _MSC_VER
+         unsigned long bit;
+         _BitScanForward64(&bit, ~static_cast<unsigned long long>(k));
+         return bit;
+      #else
+         return __builtin_ctzll(~static_cast<unsigned long long>(k));
+      #endif
+   }
+};
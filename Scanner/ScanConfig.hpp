@@ -0,0 +1,415 @@
+#pragma once
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/**
+ * Scan options that can be changed from the command line. Every option has
+ * the form --name=value and the defaults are what the scanner always did.
+ **/
+struct ScanConfig
+{
+   enum class IoEngine_e
+   {
+      Poll,
+      Epoll,
+      IoUring,
+   };
+
+   enum class Discovery_e
+   {
+      None,
+      Syn,
+   };
+
+   enum class SocketProfile_e
+   {
+      Default,
+      Scan,
+   };
+
+   enum class Order_e
+   {
+      BlackRock,
+      Cyclic,
+   };
+
+   #ifdef __linux__
+      IoEngine_e io_engine = IoEngine_e::Epoll;
+   #else
+      IoEngine_e io_engine = IoEngine_e::Poll;
+   #endif
+
+   // New connections per second over all threads (0 = as fast as slots free up)
+   double connect_rate = 0;
+
+   // Connections that can be started at once after an idle period. Defaults to
+   // 50 ms worth of connect_rate
+   double connect_burst = 0;
+
+   // Threads running the TLS handshakes (0 = twice the number of cores, or
+   // one per core when pinned)
+   unsigned tls_threads = 0;
+
+   // Pin every TLS thread to its own core, which then holds its connection
+   // table, buffers and SSL objects in local memory
+   bool pin_threads = false;
+
+   // Threads generating targets for the TLS threads. With 0, every TLS
+   // thread sweeps its own slice of the range. With SYN discovery these
+   // are the transmit threads and there is at least one
+   unsigned gen_threads = 0;
+
+   // Targets buffered between each generator and each TLS thread
+   size_t queue_depth = 4096;
+
+   // Files listing the prefixes to sweep, one a.b.c.d/n per line (empty =
+   // the built-in range)
+   std::vector<std::string> include_files;
+
+   // Files listing more prefixes left out of the sweep
+   std::vector<std::string> exclude_files;
+
+   // Leave the special-purpose address blocks (private, loopback, multicast,
+   // ...) out of the sweep
+   bool exclude_reserved = true;
+
+   // More prefixes left out of the sweep, as a.b.c.d/n
+   std::vector<std::string> excluded_ranges;
+
+   // Ports probed on every address, in one sweep of all the pairs
+   std::vector<unsigned short> ports{ 443 };
+
+   // Permutation that randomizes the order of the targets. Cyclic steps
+   // through a multiplicative group mod a prime, with the same cost for
+   // every target
+   Order_e order = Order_e::BlackRock;
+
+   // Targets a sweeping thread takes at once from the range shared by all
+   // of them (0 = every thread sweeps a fixed slice of the range)
+   size_t chunk_size = 1024;
+
+   // Send a ClientHello built once at startup instead of running an OpenSSL
+   // handshake per connection
+   bool hello_template = false;
+
+   // Send a close_notify alert when the server's flight is in, instead of
+   // just closing the connection
+   bool close_alert = false;
+
+   // Read ICMP errors to tell filtered targets from unreachable ones
+   bool recv_icmp_errors = false;
+
+   // Kernel settings of the scan sockets. Scan uses small buffers, no SYN
+   // retransmit after the connection timeout, TCP_NODELAY and closes with
+   // a RST
+   SocketProfile_e socket_profile = SocketProfile_e::Default;
+
+   // SO_RCVBUF and SO_SNDBUF of the scan sockets, over the profile's (0 =
+   // as in the profile)
+   int recv_buffer = 0;
+   int send_buffer = 0;
+
+   // Local addresses the TLS connections are spread over (empty = the one
+   // routing to the targets). Each adds its own range of ephemeral ports
+   std::vector<std::string> source_addresses;
+
+   // How targets are found before their TLS handshake. With Syn, only hosts
+   // that answer a raw SYN get a real connection
+   Discovery_e discovery = Discovery_e::None;
+
+   // Address the SYNs are sent from (empty = the one routing to the targets)
+   std::string syn_source;
+
+   // How long to keep listening for SYN-ACKs after the last SYN is sent (ms)
+   int syn_wait = 10000;
+
+   static ScanConfig parse(int argc, char* argv[])
+   {
+      ScanConfig config;
+
+      for (int i = 1; i < argc; ++i)
+      {
+         const std::string_view arg(argv[i]);
+         const auto eq = arg.find('=');
+         if ((arg.substr(0, 2) != "--") || (eq == std::string_view::npos))
+         {
+            throw std::invalid_argument("Malformed option '" + std::string(arg) + "'");
+         }
+
+         const auto name = arg.substr(2, eq - 2);
+         const auto value = arg.substr(eq + 1);
+
+         if (name == "engine")
+         {
+            if (value == "poll")
+            {
+               config.io_engine = IoEngine_e::Poll;
+            }
+            #ifdef __linux__
+               else if (value == "epoll")
+               {
+                  config.io_engine = IoEngine_e::Epoll;
+               }
+               else if (value == "uring")
+               {
+                  config.io_engine = IoEngine_e::IoUring;
+               }
+            #endif
+            else
+            {
+               throw std::invalid_argument("Unsupported engine '" + std::string(value) + "'");
+            }
+         }
+         else if (name == "rate")
+         {
+            config.connect_rate = parse_number(name, value);
+         }
+         else if (name == "burst")
+         {
+            config.connect_burst = parse_number(name, value);
+         }
+         else if (name == "tls-threads")
+         {
+            config.tls_threads = static_cast<unsigned>(parse_number(name, value));
+         }
+         else if (name == "pin")
+         {
+            config.pin_threads = parse_flag(name, value);
+         }
+         else if (name == "gen-threads")
+         {
+            config.gen_threads = static_cast<unsigned>(parse_number(name, value));
+         }
+         else if (name == "queue-depth")
+         {
+            config.queue_depth = static_cast<size_t>(parse_number(name, value));
+            if (config.queue_depth == 0)
+            {
+               throw std::invalid_argument("queue-depth must be at least 1");
+            }
+         }
+         else if (name == "exclude-reserved")
+         {
+            config.exclude_reserved = parse_flag(name, value);
+         }
+         else if (name == "exclude")
+         {
+            for (const auto& it : split_list(name, value))
+            {
+               config.excluded_ranges.emplace_back(it);
+            }
+         }
+         else if (name == "include-file")
+         {
+            config.include_files.emplace_back(value);
+         }
+         else if (name == "exclude-file")
+         {
+            config.exclude_files.emplace_back(value);
+         }
+         else if (name == "ports")
+         {
+            config.ports.clear();
+            for (const auto& it : split_list(name, value))
+            {
+               const double port = parse_number(name, it);
+               if ((port < 1) || (port > 65535) || (port != static_cast<unsigned short>(port)))
+               {
+                  throw std::invalid_argument("Invalid port '" + std::string(it) + "'");
+               }
+               config.ports.push_back(static_cast<unsigned short>(port));
+            }
+         }
+         else if (name == "order")
+         {
+            if (value == "blackrock")
+            {
+               config.order = Order_e::BlackRock;
+            }
+            else if (value == "cyclic")
+            {
+               config.order = Order_e::Cyclic;
+            }
+            else
+            {
+               throw std::invalid_argument("Unsupported order '" + std::string(value) + "'");
+            }
+         }
+         else if (name == "chunk")
+         {
+            config.chunk_size = static_cast<size_t>(parse_number(name, value));
+         }
+         else if (name == "hello")
+         {
+            if (value == "openssl")
+            {
+               config.hello_template = false;
+            }
+            else if (value == "template")
+            {
+               config.hello_template = true;
+            }
+            else
+            {
+               throw std::invalid_argument("Unsupported hello '" + std::string(value) + "'");
+            }
+         }
+         else if (name == "close-alert")
+         {
+            config.close_alert = parse_flag(name, value);
+         }
+         else if (name == "recverr")
+         {
+            config.recv_icmp_errors = parse_flag(name, value);
+         }
+         else if (name == "socket-profile")
+         {
+            if (value == "default")
+            {
+               config.socket_profile = SocketProfile_e::Default;
+            }
+            else if (value == "scan")
+            {
+               config.socket_profile = SocketProfile_e::Scan;
+            }
+            else
+            {
+               throw std::invalid_argument("Unsupported socket-profile '" + std::string(value) + "'");
+            }
+         }
+         else if (name == "rcvbuf")
+         {
+            config.recv_buffer = static_cast<int>(parse_number(name, value));
+         }
+         else if (name == "sndbuf")
+         {
+            config.send_buffer = static_cast<int>(parse_number(name, value));
+         }
+         else if (name == "source")
+         {
+            config.source_addresses.clear();
+            for (const auto& it : split_list(name, value))
+            {
+               config.source_addresses.emplace_back(it);
+            }
+         }
+         else if (name == "discovery")
+         {
+            if (value == "none")
+            {
+               config.discovery = Discovery_e::None;
+            }
+            #ifdef __linux__
+               else if (value == "syn")
+               {
+                  config.discovery = Discovery_e::Syn;
+               }
+            #endif
+            else
+            {
+               throw std::invalid_argument("Unsupported discovery '" + std::string(value) + "'");
+            }
+         }
+         else if (name == "syn-source")
+         {
+            config.syn_source = value;
+         }
+         else if (name == "syn-wait")
+         {
+            config.syn_wait = static_cast<int>(parse_number(name, value));
+         }
+         else
+         {
+            throw std::invalid_argument("Unknown option '" + std::string(name) + "'");
+         }
+      }
+
+      if ((config.connect_rate > 0) && (config.connect_burst <= 0))
+      {
+         config.connect_burst = std::max(1.0, config.connect_rate / 20);
+      }
+
+      return config;
+   }
+
+   static void print_usage(const char* prog)
+   {
+      printf("Usage: %s [options]\n"
+         "  --engine=poll|epoll|uring   Socket I/O engine of the scanner threads\n"
+         "  --rate=N                    Start at most N connections per second\n"
+         "  --burst=N                   Connections that can be started at once (default rate/20)\n"
+         "  --tls-threads=N             Threads running TLS handshakes (default 2 per core, 1 when pinned)\n"
+         "  --pin=0|1                   Pin each TLS thread to a core, with its state in local memory (default 0)\n"
+         "  --gen-threads=N             Threads generating targets for them (default 0: each sweeps its own)\n"
+         "  --queue-depth=N             Targets buffered per generator and TLS thread (default 4096)\n"
+         "  --include-file=FILE         Sweep the prefixes listed in FILE, one per line (can be repeated)\n"
+         "  --exclude=CIDR[,CIDR...]    Prefixes left out of the sweep (can be repeated)\n"
+         "  --exclude-file=FILE         Leave out the prefixes listed in FILE (can be repeated)\n"
+         "  --exclude-reserved=0|1      Leave out private, loopback, multicast and other reserved blocks (default 1)\n"
+         "  --ports=P[,P...]            Ports probed on every address (default 443)\n"
+         "  --order=blackrock|cyclic    Permutation of the targets: Feistel cipher, or cyclic group mod a prime\n"
+         "  --chunk=N                   Targets a thread takes at once from the shared range (default 1024, 0: fixed slices)\n"
+         "  --hello=openssl|template    Handshake through OpenSSL, or send a precomputed TLS 1.2 ClientHello\n"
+         "  --close-alert=0|1           Send a close_notify alert before closing (default 0)\n"
+         "  --recverr=0|1               Read ICMP errors to tell filtered from unreachable (Linux)\n"
+         "  --socket-profile=NAME       default, or scan: small buffers, no late SYN retries, RST on close\n"
+         "  --rcvbuf=N                  SO_RCVBUF of the scan sockets (default: from the profile)\n"
+         "  --sndbuf=N                  SO_SNDBUF of the scan sockets (default: from the profile)\n"
+         "  --source=IP[,IP...]         Local addresses to spread the connections over\n"
+         "  --discovery=none|syn        Probe only hosts that answer a raw SYN (needs CAP_NET_RAW)\n"
+         "  --syn-source=IP             Source address of the SYNs (default: from the routing table)\n"
+         "  --syn-wait=MS               Time to wait for late SYN-ACKs (default 10000)\n",
+         prog);
+   }
+
+private:
+   static bool parse_flag(std::string_view name, std::string_view value)
+   {
+      if ((value == "1") || (value == "true"))
+      {
+         return true;
+      }
+      else if ((value == "0") || (value == "false"))
+      {
+         return false;
+      }
+      throw std::invalid_argument("Invalid value for " + std::string(name) + ": '" + std::string(value) + "'");
+   }
+
+   /**
+    * Items of a comma separated list, none of them empty
+    **/
+   static std::vector<std::string_view> split_list(std::string_view name, std::string_view value)
+   {
+      std::vector<std::string_view> items;
+      size_t pos = 0;
+      while (pos <= value.size())
+      {
+         const auto end = std::min(value.find(',', pos), value.size());
+         if (end == pos)
+         {
+            throw std::invalid_argument("Empty item in " + std::string(name) + ": '" + std::string(value) + "'");
+         }
+         items.push_back(value.substr(pos, end - pos));
+         pos = end + 1;
+      }
+      return items;
+   }
+
+   static double parse_number(std::string_view name, std::string_view value)
+   {
+      const std::string str(value);
+      char* end = nullptr;
+      const double number = strtod(str.c_str(), &end);
+      if (str.empty() || (*end != '\0') || (number < 0))
+      {
+         throw std::invalid_argument("Invalid value for " + std::string(name) + ": '" + str + "'");
+      }
+      return number;
+   }
+};
@@ -0,0 +1,83 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+#include <functional>
+#include <vector>
+
+/**
+ * Fixed-capacity table of objects addressed by slot index.
+ *
+ * Objects never move: a slot is taken from the free list when a connection
+ * starts and given back when it ends, so slot indices can be used as keys by
+ * the event engine and the timer wheel for the whole life of a connection.
+ * The free list is a min-heap, so the lowest free slot is reused first. The
+ * slots in use stay packed at the start of the table, and a poll() over the
+ * slots up to the highest one in use does not scan the ones left free.
+ **/
+template<typename T>
+class SlotTable
+{
+public:
+   explicit SlotTable(size_t capacity) :
+      m_slots(capacity)
+   {
+      // In ascending order, which is already a min-heap
+      m_free.reserve(capacity);
+      for (size_t i = 0; i < capacity; ++i)
+      {
+         m_free.push_back(static_cast<uint32_t>(i));
+      }
+   }
+
+   T& operator[](size_t slot) noexcept
+   {
+      return m_slots[slot];
+   }
+
+   const T& operator[](size_t slot) const noexcept
+   {
+      return m_slots[slot];
+   }
+
+   size_t capacity() const noexcept
+   {
+      return m_slots.size();
+   }
+
+   size_t available() const noexcept
+   {
+      return m_free.size();
+   }
+
+   size_t in_use() const noexcept
+   {
+      return m_slots.size() - m_free.size();
+   }
+
+   /**
+    * Takes the lowest free slot. Returns false if all of them are in use.
+    **/
+   bool acquire(size_t* slot) noexcept
+   {
+      if (m_free.empty())
+      {
+         return false;
+      }
+
+      std::pop_heap(m_free.begin(), m_free.end(), std::greater<uint32_t>());
+      *slot = m_free.back();
+      m_free.pop_back();
+      return true;
+   }
+
+   void release(size_t slot) noexcept
+   {
+      m_free.push_back(static_cast<uint32_t>(slot));
+      std::push_heap(m_free.begin(), m_free.end(), std::greater<uint32_t>());
+   }
+
+private:
+   std::vector<T> m_slots;
+   std::vector<uint32_t> m_free;
+};
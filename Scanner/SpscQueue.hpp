@@ -0,0 +1,106 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <vector>
+
+/**
+ * Bounded single-producer single-consumer ring of T.
+ *
+ * try_push() must only be called from one thread and try_pop() from one
+ * other thread. Neither takes a lock: the producer owns the tail, the
+ * consumer owns the head and each side only reads the other's index when
+ * its cached copy says the ring looks full (or empty). Both indices live
+ * on their own cache line so the two threads do not bounce it.
+ **/
+template<typename T>
+class SpscQueue
+{
+public:
+   /**
+    * @param capacity
+    *      Rounded up to a power of two
+    */
+   explicit SpscQueue(size_t capacity) :
+      m_items(round_up(capacity)),
+      m_mask(m_items.size() - 1)
+   {}
+
+   SpscQueue(const SpscQueue&) = delete;
+   SpscQueue& operator=(const SpscQueue&) = delete;
+
+   bool try_push(const T& item) noexcept
+   {
+      const size_t tail = m_tail.load(std::memory_order_relaxed);
+      if ((tail - m_cached_head) == m_items.size())
+      {
+         m_cached_head = m_head.load(std::memory_order_acquire);
+         if ((tail - m_cached_head) == m_items.size())
+         {
+            return false;
+         }
+      }
+
+      m_items[tail & m_mask] = item;
+      m_tail.store(tail + 1, std::memory_order_release);
+      return true;
+   }
+
+   bool try_pop(T* item) noexcept
+   {
+      const size_t head = m_head.load(std::memory_order_relaxed);
+      if (head == m_cached_tail)
+      {
+         m_cached_tail = m_tail.load(std::memory_order_acquire);
+         if (head == m_cached_tail)
+         {
+            return false;
+         }
+      }
+
+      *item = m_items[head & m_mask];
+      m_head.store(head + 1, std::memory_order_release);
+      return true;
+   }
+
+   /**
+    * Items waiting. Only a snapshot when called from a third thread.
+    **/
+   size_t size() const noexcept
+   {
+      return m_tail.load(std::memory_order_acquire) - m_head.load(std::memory_order_acquire);
+   }
+
+   bool empty() const noexcept
+   {
+      return size() == 0;
+   }
+
+   size_t capacity() const noexcept
+   {
+      return m_items.size();
+   }
+
+private:
+   static constexpr size_t cache_line = 64;
+
+   std::vector<T> m_items;
+   const size_t m_mask;
+
+   // Consumer side
+   alignas(cache_line) std::atomic_size_t m_head{ 0 };
+   size_t m_cached_tail = 0;
+
+   // Producer side
+   alignas(cache_line) std::atomic_size_t m_tail{ 0 };
+   size_t m_cached_head = 0;
+
+   static size_t round_up(size_t capacity) noexcept
+   {
+      size_t size = 1;
+      while (size < capacity)
+      {
+         size <<= 1;
+      }
+      return size;
+   }
+};
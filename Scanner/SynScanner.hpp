@@ -0,0 +1,365 @@
+#pragma once
+#ifdef __linux__
+#include <cstdio>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <random>
+#include <system_error>
+#include <vector>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include "ConnSocket.hpp"
+#include "IPSpaceSweeper.hpp"
+#include "TargetQueue.hpp"
+#include "TokenBucket.hpp"
+
+/**
+ * Stateless SYN discovery, in the style of masscan.
+ *
+ * transmit() sweeps the target space sending bare SYNs through a raw socket.
+ * No kernel socket or scanner slot is held for them. The sequence number of
+ * every SYN is a keyed hash of the destination, so receive() can tell a
+ * SYN-ACK to one of our probes from any other traffic without keeping state.
+ * Every responsive ip:port is pushed once to the output queue, for the TLS
+ * stage to connect to. Several threads can transmit (each one its own
+ * slice of the range) while one thread receives.
+ *
+ * The kernel does not know about these connections and answers every SYN-ACK
+ * with a RST, which is what we want: the real connection is made later.
+ *
+ * Needs CAP_NET_RAW. scripts/syn-netns-test.sh runs it between two network
+ * namespaces, away from any real network.
+ **/
+class SynScanner
+{
+public:
+   SynScanner(const SynScanner&) = delete;
+   SynScanner& operator=(const SynScanner&) = delete;
+
+   /**
+    * @param source_ip
+    *      Address the SYNs are sent from, in host byte order. 0 picks the
+    *      address the kernel would route the first target from.
+    */
+   explicit SynScanner(unsigned long source_ip) :
+      m_source_ip(source_ip),
+      m_secret(std::random_device()() | (static_cast<uint64_t>(std::random_device()()) << 32)),
+      m_seen(seen_table_size, 0)
+   {
+      // IPPROTO_RAW implies IP_HDRINCL: we build the whole IP header
+      m_tx_sock = ::socket(AF_INET, SOCK_RAW, IPPROTO_RAW);
+      if (m_tx_sock < 0)
+      {
+         throw std::system_error(errno, std::generic_category(), "socket(SOCK_RAW, IPPROTO_RAW)");
+      }
+
+      // Receives a copy of every TCP segment that reaches this host
+      m_rx_sock = ::socket(AF_INET, SOCK_RAW | SOCK_NONBLOCK, IPPROTO_TCP);
+      if (m_rx_sock < 0)
+      {
+         const auto err = errno;
+         close(m_tx_sock);
+         throw std::system_error(err, std::generic_category(), "socket(SOCK_RAW, IPPROTO_TCP)");
+      }
+
+      const int rcvbuf = 8 * 1024 * 1024;
+      setsockopt(m_rx_sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+   }
+
+   ~SynScanner()
+   {
+      close(m_rx_sock);
+      close(m_tx_sock);
+   }
+
+   /**
+    * Sends a SYN to every target of range, at the pace allowed by pacer
+    **/
+   void transmit(IPSpaceSweeper range, TokenBucket pacer, const std::atomic_bool& keep_running)
+   {
+      packet_t packets[batch_size];
+      sockaddr_in addrs[batch_size];
+      iovec iovs[batch_size];
+      mmsghdr msgs[batch_size];
+      memset(msgs, 0, sizeof(msgs));
+
+      target_t target;
+      bool have_target = range.try_get(&target);
+      if (have_target)
+      {
+         std::call_once(m_source_resolved, [&]()
+            {
+               if (m_source_ip == 0)
+               {
+                  m_source_ip = route_source(target.ip);
+               }
+               printf("SYN discovery from %lu.%lu.%lu.%lu:%u\n", (m_source_ip >> 24) & 0xFF, (m_source_ip >> 16) & 0xFF, (m_source_ip >> 8) & 0xFF, m_source_ip & 0xFF, source_port);
+            });
+      }
+
+      while (have_target && keep_running)
+      {
+         size_t allowed = pacer.take(batch_size, GetTickCount64());
+         if (allowed == 0)
+         {
+            usleep(1000 * pacer.next_token_in(GetTickCount64()));
+            continue;
+         }
+
+         unsigned count = 0;
+         for (; (count < allowed) && have_target; ++count)
+         {
+            build_syn(&packets[count], target);
+            addrs[count] = {};
+            addrs[count].sin_family = AF_INET;
+            addrs[count].sin_addr.s_addr = htonl(static_cast<uint32_t>(target.ip));
+            iovs[count] = { &packets[count], sizeof(packet_t) };
+            msgs[count].msg_hdr.msg_name = &addrs[count];
+            msgs[count].msg_hdr.msg_namelen = sizeof(addrs[count]);
+            msgs[count].msg_hdr.msg_iov = &iovs[count];
+            msgs[count].msg_hdr.msg_iovlen = 1;
+
+            have_target = range.try_get(&target);
+         }
+
+         unsigned sent = 0;
+         while (sent < count)
+         {
+            const int ret = sendmmsg(m_tx_sock, msgs + sent, count - sent, 0);
+            if (ret < 0)
+            {
+               if ((errno == ENOBUFS) || (errno == EAGAIN) || (errno == EINTR))
+               {  // The NIC queue is full. Back off and retry
+                  usleep(100);
+                  continue;
+               }
+
+               // Unroutable targets and the like. Skip that one
+               printf("sendmmsg error - Error=%d\n", errno);
+               ++sent;
+               continue;
+            }
+            sent += ret;
+         }
+
+         m_sent += count;
+      }
+   }
+
+   /**
+    * Collects the answers to our SYNs until transmission is done and then for
+    * another wait ms, for the late ones. Only one thread can receive.
+    **/
+   void receive(TargetQueue::Writer output, const std::atomic_bool& tx_done, int wait, const std::atomic_bool& keep_running)
+   {
+      unsigned long long done_since = 0;
+      uint8_t buf[2048];
+
+      while (keep_running)
+      {
+         if (tx_done)
+         {
+            const auto now = GetTickCount64();
+            if (done_since == 0)
+            {
+               done_since = now;
+            }
+            else if ((now - done_since) >= static_cast<unsigned long long>(wait))
+            {
+               break;
+            }
+         }
+
+         pollfd fda{ m_rx_sock, POLLIN, 0 };
+         if (poll(&fda, 1, 100) <= 0)
+         {
+            continue;
+         }
+
+         for (;;)
+         {
+            const auto len = ::recv(m_rx_sock, buf, sizeof(buf), 0);
+            if (len <= 0)
+            {
+               break;
+            }
+
+            target_t target;
+            if (parse_syn_ack(buf, static_cast<size_t>(len), &target) && first_time_seen(target))
+            {
+               ++m_responsive;
+               output.push(target, keep_running);
+            }
+         }
+      }
+   }
+
+   size_t get_sent() const noexcept
+   {
+      return m_sent;
+   }
+
+   size_t get_responsive() const noexcept
+   {
+      return m_responsive;
+   }
+
+private:
+   static constexpr unsigned batch_size = 64;
+   static constexpr unsigned short source_port = 61000;
+   static constexpr size_t seen_table_size = 1 << 16;
+
+   #pragma pack(push, 1)
+   struct packet_t
+   {
+      iphdr    ip;
+      tcphdr   tcp;
+      uint8_t  options[4];    // MSS, some stacks drop a SYN without it
+   };
+   #pragma pack(pop)
+
+   unsigned long m_source_ip;
+   std::once_flag m_source_resolved;
+   uint64_t m_secret;
+   int m_tx_sock = -1;
+   int m_rx_sock = -1;
+   std::atomic_size_t m_sent{ 0 };
+   std::atomic_size_t m_responsive{ 0 };
+
+   // Recent responders, so retransmitted SYN-ACKs are not probed twice
+   std::vector<uint64_t> m_seen;
+
+   uint32_t cookie(uint32_t ip, uint16_t port) const noexcept
+   {
+      uint64_t x = ((static_cast<uint64_t>(ip) << 16) | port) ^ m_secret;
+      x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+      x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+      x = x ^ (x >> 31);
+      return static_cast<uint32_t>(x);
+   }
+
+   static uint16_t checksum(const void* data, size_t len, uint32_t sum = 0) noexcept
+   {
+      auto p = static_cast<const uint8_t*>(data);
+      for (; len > 1; len -= 2, p += 2)
+      {
+         sum += (p[0] << 8) | p[1];
+      }
+      if (len)
+      {
+         sum += p[0] << 8;
+      }
+      while (sum >> 16)
+      {
+         sum = (sum & 0xFFFF) + (sum >> 16);
+      }
+      return htons(static_cast<uint16_t>(~sum));
+   }
+
+   void build_syn(packet_t* pkt, const target_t& target) const noexcept
+   {
+      memset(pkt, 0, sizeof(*pkt));
+
+      pkt->ip.version = 4;
+      pkt->ip.ihl = 5;
+      pkt->ip.ttl = 64;
+      pkt->ip.protocol = IPPROTO_TCP;
+      pkt->ip.tot_len = htons(sizeof(packet_t));
+      pkt->ip.saddr = htonl(static_cast<uint32_t>(m_source_ip));
+      pkt->ip.daddr = htonl(static_cast<uint32_t>(target.ip));
+      // The kernel fills in the IP checksum and the packet id
+
+      pkt->tcp.source = htons(source_port);
+      pkt->tcp.dest = htons(target.port);
+      pkt->tcp.seq = htonl(cookie(static_cast<uint32_t>(target.ip), target.port));
+      pkt->tcp.doff = (sizeof(tcphdr) + sizeof(pkt->options)) / 4;
+      pkt->tcp.syn = 1;
+      pkt->tcp.window = htons(1024);
+      pkt->options[0] = 2;    // MSS
+      pkt->options[1] = 4;
+      pkt->options[2] = 1460 >> 8;
+      pkt->options[3] = 1460 & 0xFF;
+
+      // Pseudo header: source, destination, protocol and TCP length
+      const uint32_t src = static_cast<uint32_t>(m_source_ip);
+      const uint32_t dst = static_cast<uint32_t>(target.ip);
+      uint32_t sum = (src >> 16) + (src & 0xFFFF) + (dst >> 16) + (dst & 0xFFFF);
+      sum += IPPROTO_TCP + sizeof(tcphdr) + sizeof(pkt->options);
+      pkt->tcp.check = checksum(&pkt->tcp, sizeof(tcphdr) + sizeof(pkt->options), sum);
+   }
+
+   bool parse_syn_ack(const uint8_t* buf, size_t len, target_t* target) const noexcept
+   {
+      if (len < sizeof(iphdr))
+      {
+         return false;
+      }
+
+      auto ip = reinterpret_cast<const iphdr*>(buf);
+      const size_t ip_len = ip->ihl * 4;
+      if ((ip->version != 4) || (ip->protocol != IPPROTO_TCP) || (len < ip_len + sizeof(tcphdr)))
+      {
+         return false;
+      }
+
+      auto tcp = reinterpret_cast<const tcphdr*>(buf + ip_len);
+      if (!tcp->syn || !tcp->ack || (ntohs(tcp->dest) != source_port))
+      {
+         return false;
+      }
+
+      target->ip = ntohl(ip->saddr);
+      target->port = ntohs(tcp->source);
+      return ntohl(tcp->ack_seq) == (cookie(static_cast<uint32_t>(target->ip), target->port) + 1);
+   }
+
+   bool first_time_seen(const target_t& target) noexcept
+   {
+      const uint64_t key = ((static_cast<uint64_t>(target.ip) << 16) | target.port) + 1;
+      auto& entry = m_seen[cookie(static_cast<uint32_t>(target.ip), target.port) % seen_table_size];
+      if (entry == key)
+      {
+         return false;
+      }
+      entry = key;
+      return true;
+   }
+
+   /**
+    * Source address the kernel would use to reach ip (host byte order)
+    **/
+   static unsigned long route_source(unsigned long ip)
+   {
+      int sock = ::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+      if (sock < 0)
+      {
+         throw std::system_error(errno, std::generic_category(), "socket(SOCK_DGRAM)");
+      }
+
+      sockaddr_in dst{};
+      dst.sin_family = AF_INET;
+      dst.sin_addr.s_addr = htonl(static_cast<uint32_t>(ip));
+      dst.sin_port = htons(443);
+
+      sockaddr_in src{};
+      socklen_t src_len = sizeof(src);
+      if ((::connect(sock, reinterpret_cast<sockaddr*>(&dst), sizeof(dst)) != 0) ||
+          (getsockname(sock, reinterpret_cast<sockaddr*>(&src), &src_len) != 0))
+      {
+         const auto err = errno;
+         close(sock);
+         throw std::system_error(err, std::generic_category(), "Finding the source address for SYN discovery");
+      }
+
+      close(sock);
+      return ntohl(src.sin_addr.s_addr);
+   }
+};
+
+#endif
@@ -0,0 +1,186 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <thread>
+#include <vector>
+#include "IPSpaceSweeper.hpp"
+#include "SpscQueue.hpp"
+
+/**
+ * Hand-off of targets from the threads that find them (sweep generators or
+ * SYN discovery) to the scanner threads that make the TLS connections.
+ *
+ * There is one bounded SpscQueue per producer and consumer pair, so no
+ * lock is needed on either side. A producer spreads its targets round-robin
+ * over its row of queues. When they are all full it waits, which is the
+ * backpressure that keeps generation from running ahead of the handshakes.
+ * A consumer reads round-robin over its column.
+ *
+ * The queue is finished for a consumer once every producer has closed its
+ * Writer and the consumer's column has been drained.
+ **/
+class TargetQueue
+{
+public:
+   TargetQueue(size_t num_of_producers, size_t num_of_consumers, size_t depth) :
+      m_num_of_producers(num_of_producers),
+      m_num_of_consumers(num_of_consumers),
+      m_open_producers(num_of_producers)
+   {
+      m_queues.reserve(num_of_producers * num_of_consumers);
+      for (size_t i = 0; i < num_of_producers * num_of_consumers; ++i)
+      {
+         m_queues.emplace_back(std::make_unique<SpscQueue<target_t>>(depth));
+      }
+   }
+
+   TargetQueue(const TargetQueue&) = delete;
+   TargetQueue& operator=(const TargetQueue&) = delete;
+
+   /**
+    * What a producer thread holds to push its targets
+    **/
+   class Writer
+   {
+   public:
+      Writer(TargetQueue& queue, size_t producer) : m_queue(&queue), m_producer(producer) {}
+
+      /**
+       * Waits while every queue of this producer is full. Returns false if
+       * keep_running was cleared meanwhile.
+       **/
+      bool push(const target_t& target, const std::atomic_bool& keep_running)
+      {
+         bool stalled = false;
+         while (keep_running)
+         {
+            for (size_t n = 0; n < m_queue->m_num_of_consumers; ++n)
+            {
+               const size_t consumer = m_next;
+               m_next = (m_next + 1) % m_queue->m_num_of_consumers;
+               if (m_queue->queue(m_producer, consumer).try_push(target))
+               {
+                  return true;
+               }
+            }
+
+            if (!stalled)
+            {
+               stalled = true;
+               ++m_queue->m_stalls;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+         }
+         return false;
+      }
+
+      /**
+       * No more targets will come from this producer
+       **/
+      void close()
+      {
+         --m_queue->m_open_producers;
+      }
+
+   private:
+      TargetQueue* m_queue;
+      size_t m_producer;
+      size_t m_next = 0;
+   };
+
+   /**
+    * What a scanner thread holds to take its targets from the queue. It has
+    * the same interface the scanner threads use on IPSpaceSweeper.
+    **/
+   class Reader
+   {
+   public:
+      Reader(TargetQueue& queue, size_t consumer) : m_queue(&queue), m_consumer(consumer) {}
+
+      bool has_range_finished() const
+      {
+         if (m_queue->m_open_producers > 0)
+         {
+            return false;
+         }
+
+         for (size_t producer = 0; producer < m_queue->m_num_of_producers; ++producer)
+         {
+            if (!m_queue->queue(producer, m_consumer).empty())
+            {
+               return false;
+            }
+         }
+         return true;
+      }
+
+      bool try_get(target_t* target)
+      {
+         for (size_t n = 0; n < m_queue->m_num_of_producers; ++n)
+         {
+            const size_t producer = m_next;
+            m_next = (m_next + 1) % m_queue->m_num_of_producers;
+            if (m_queue->queue(producer, m_consumer).try_pop(target))
+            {
+               return true;
+            }
+         }
+         return false;
+      }
+
+   private:
+      TargetQueue* m_queue;
+      size_t m_consumer;
+      size_t m_next = 0;
+   };
+
+   Writer get_writer(size_t producer)
+   {
+      return Writer(*this, producer);
+   }
+
+   Reader get_reader(size_t consumer)
+   {
+      return Reader(*this, consumer);
+   }
+
+   /**
+    * Targets waiting for a scanner thread, over all queues
+    **/
+   size_t depth() const noexcept
+   {
+      size_t depth = 0;
+      for (const auto& it : m_queues)
+      {
+         depth += it->size();
+      }
+      return depth;
+   }
+
+   size_t capacity() const noexcept
+   {
+      return m_queues.empty() ? 0 : m_queues.size() * m_queues.front()->capacity();
+   }
+
+   /**
+    * Times a producer found all its queues full and had to wait
+    **/
+   size_t get_stalls() const noexcept
+   {
+      return m_stalls;
+   }
+
+private:
+   const size_t m_num_of_producers;
+   const size_t m_num_of_consumers;
+   std::vector<std::unique_ptr<SpscQueue<target_t>>> m_queues;
+   std::atomic_size_t m_open_producers;
+   std::atomic_size_t m_stalls{ 0 };
+
+   SpscQueue<target_t>& queue(size_t producer, size_t consumer) noexcept
+   {
+      return *m_queues[producer * m_num_of_consumers + consumer];
+   }
+};
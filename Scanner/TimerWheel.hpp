@@ -0,0 +1,179 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+/**
+ * Hashed timing wheel for the connection deadlines of one scanner thread.
+ *
+ * Each slot owns at most one timer. Timers hash into the bucket of their
+ * expiration tick and are kept in intrusive lists indexed by slot, so
+ * scheduling, rescheduling and cancelling are O(1) and nothing is
+ * allocated after construction. expire() only visits the buckets of the
+ * ticks that passed, so its cost is proportional to the number of expired
+ * timers. Timers further away than one turn of the wheel stay in their
+ * bucket until the turn they belong to.
+ **/
+class TimerWheel
+{
+public:
+   /**
+    * @param capacity
+    *      Number of slots that can have a timer.
+    * @param tick
+    *      Resolution of the wheel in ms.
+    * @param num_of_buckets
+    *      Buckets in the wheel. A turn of the wheel lasts tick * num_of_buckets ms
+    *      and should be longer than the usual timeout.
+    * @param now
+    *      Current time in ms.
+    */
+   TimerWheel(size_t capacity, unsigned tick, size_t num_of_buckets, unsigned long long now) :
+      m_tick(tick),
+      m_current_tick(now / tick),
+      m_buckets(num_of_buckets, npos),
+      m_entries(capacity)
+   {}
+
+   /**
+    * Arms the timer of slot to expire at deadline (in ms). If the timer was
+    * already armed, it is moved to the new deadline.
+    **/
+   void schedule(size_t slot, unsigned long long deadline) noexcept
+   {
+      auto& entry = m_entries[slot];
+      if (entry.armed)
+      {
+         if (entry.deadline == deadline)
+         {
+            return;
+         }
+         unlink(slot);
+      }
+
+      entry.deadline = deadline;
+      entry.armed = true;
+
+      // Something that is already late goes in the bucket that is processed next
+      const auto expire_tick = std::max(deadline / m_tick, m_current_tick);
+      entry.bucket = static_cast<uint32_t>(expire_tick % m_buckets.size());
+      auto& head = m_buckets[entry.bucket];
+      entry.prev = npos;
+      entry.next = head;
+      if (head != npos)
+      {
+         m_entries[head].prev = static_cast<uint32_t>(slot);
+      }
+      head = static_cast<uint32_t>(slot);
+      ++m_count;
+   }
+
+   void cancel(size_t slot) noexcept
+   {
+      if (m_entries[slot].armed)
+      {
+         unlink(slot);
+      }
+   }
+
+   /**
+    * Calls on_expired(slot) for every timer whose deadline is <= now. The timer
+    * is disarmed before the call, so on_expired may schedule it again.
+    **/
+   template<typename Func>
+   size_t expire(unsigned long long now, Func&& on_expired)
+   {
+      size_t expired = 0;
+      const auto now_tick = now / m_tick;
+
+      // A full turn visits every bucket. Going further would only revisit them
+      const auto last_tick = std::min(now_tick, m_current_tick + m_buckets.size() - 1);
+      for (auto tick = m_current_tick; (tick <= last_tick) && (m_count != 0); ++tick)
+      {
+         auto slot = m_buckets[tick % m_buckets.size()];
+         while (slot != npos)
+         {
+            const auto next = m_entries[slot].next;
+            if (m_entries[slot].deadline <= now)
+            {
+               unlink(slot);
+               ++expired;
+               on_expired(static_cast<size_t>(slot));
+            }
+            slot = next;
+         }
+      }
+
+      m_current_tick = std::max(m_current_tick, now_tick);
+      return expired;
+   }
+
+   /**
+    * How long a reactor can sleep before the next timer expires, in ms, but
+    * never more than max_wait.
+    **/
+   int next_timeout(unsigned long long now, int max_wait) const noexcept
+   {
+      if (m_count == 0)
+      {
+         return max_wait;
+      }
+
+      const auto max_ticks = std::min<unsigned long long>(m_buckets.size(), (max_wait / m_tick) + 1);
+      for (unsigned long long i = 0; i < max_ticks; ++i)
+      {
+         const auto tick = m_current_tick + i;
+         if (m_buckets[tick % m_buckets.size()] != npos)
+         {
+            const auto tick_end = (tick + 1) * m_tick;
+            return (tick_end <= now) ? 0 : static_cast<int>(std::min<unsigned long long>(tick_end - now, max_wait));
+         }
+      }
+
+      return max_wait;
+   }
+
+   size_t size() const noexcept
+   {
+      return m_count;
+   }
+
+private:
+   static constexpr uint32_t npos = UINT32_MAX;
+
+   struct entry_t
+   {
+      unsigned long long deadline = 0;
+      uint32_t next = npos;
+      uint32_t prev = npos;
+      uint32_t bucket = 0;
+      bool armed = false;
+   };
+
+   unsigned m_tick;
+   unsigned long long m_current_tick;
+   size_t m_count = 0;
+   std::vector<uint32_t> m_buckets;
+   std::vector<entry_t> m_entries;
+
+   void unlink(size_t slot) noexcept
+   {
+      auto& entry = m_entries[slot];
+      if (entry.prev != npos)
+      {
+         m_entries[entry.prev].next = entry.next;
+      }
+      else
+      {
+         m_buckets[entry.bucket] = entry.next;
+      }
+
+      if (entry.next != npos)
+      {
+         m_entries[entry.next].prev = entry.prev;
+      }
+
+      entry.armed = false;
+      --m_count;
+   }
+};
@@ -0,0 +1,163 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <algorithm>
+
+/**
+ * Follows the TLS records and handshake messages of a server's first flight
+ * as its bytes arrive, without buffering or decrypting anything.
+ *
+ * feed() takes only the bytes that were not fed before. Record and message
+ * headers can be split across any number of calls. The flight is over as
+ * soon as the Certificate (or, for anonymous suites, ServerHelloDone) is
+ * complete, the server sends an alert, or the bytes are not TLS at all.
+ *
+ * Handshake messages after a ChangeCipherSpec are encrypted, so a TLS 1.3
+ * flight is never seen to end here; the OpenSSL handshake tells when it does.
+ **/
+class TlsFlightFramer
+{
+public:
+   enum class Status_e : uint8_t
+   {
+      NeedMore,
+      Done,
+      Alert,
+      NotTls,
+   };
+
+   void reset() noexcept
+   {
+      *this = TlsFlightFramer();
+   }
+
+   Status_e get_status() const noexcept
+   {
+      return m_status;
+   }
+
+   Status_e feed(const uint8_t* data, size_t len) noexcept
+   {
+      while ((len > 0) && (m_status == Status_e::NeedMore))
+      {
+         if (m_record_left == 0)
+         {
+            const size_t n = std::min(len, record_header_len - m_header_len);
+            std::copy(data, data + n, m_header + m_header_len);
+            m_header_len += static_cast<uint8_t>(n);
+            data += n;
+            len -= n;
+
+            if (m_header_len == record_header_len)
+            {
+               m_header_len = 0;
+               start_record();
+            }
+            continue;
+         }
+
+         const size_t n = std::min<size_t>(len, m_record_left);
+         if ((m_record_type == record_handshake) && !m_encrypted)
+         {
+            feed_handshake(data, n);
+         }
+         data += n;
+         len -= n;
+         m_record_left -= static_cast<uint16_t>(n);
+      }
+
+      return m_status;
+   }
+
+private:
+   static constexpr size_t record_header_len = 5;
+   static constexpr size_t message_header_len = 4;
+   static constexpr uint8_t record_change_cipher_spec = 20;
+   static constexpr uint8_t record_alert = 21;
+   static constexpr uint8_t record_handshake = 22;
+   static constexpr uint8_t record_application_data = 23;
+   static constexpr uint8_t handshake_certificate = 11;
+   static constexpr uint8_t handshake_server_hello_done = 14;
+
+   // Kept small, it is part of every socket's hot fields
+   Status_e m_status = Status_e::NeedMore;
+
+   // Current record
+   uint8_t  m_header[record_header_len] = {};
+   uint8_t  m_header_len = 0;
+   uint8_t  m_record_type = 0;
+   bool     m_encrypted = false;
+   uint16_t m_record_left = 0;
+
+   // Current handshake message, which can span records
+   uint8_t  m_message_header[message_header_len] = {};
+   uint8_t  m_message_header_len = 0;
+   uint8_t  m_message_type = 0;
+   bool     m_in_message_body = false;
+   uint32_t m_message_left = 0;
+
+   void start_record() noexcept
+   {
+      m_record_type = m_header[0];
+      m_record_left = static_cast<uint16_t>((m_header[3] << 8) | m_header[4]);
+
+      if ((m_record_type < record_change_cipher_spec) || (m_record_type > record_application_data) || (m_header[1] != 3))
+      {
+         m_status = Status_e::NotTls;
+      }
+      else if (m_record_type == record_alert)
+      {
+         m_status = Status_e::Alert;
+      }
+      else if (m_record_type == record_change_cipher_spec)
+      {
+         m_encrypted = true;
+      }
+   }
+
+   void feed_handshake(const uint8_t* data, size_t len) noexcept
+   {
+      while ((len > 0) && (m_status == Status_e::NeedMore))
+      {
+         if (!m_in_message_body)
+         {
+            const size_t n = std::min(len, message_header_len - m_message_header_len);
+            std::copy(data, data + n, m_message_header + m_message_header_len);
+            m_message_header_len += static_cast<uint8_t>(n);
+            data += n;
+            len -= n;
+
+            if (m_message_header_len == message_header_len)
+            {
+               m_message_header_len = 0;
+               m_message_type = m_message_header[0];
+               m_message_left = (m_message_header[1] << 16) | (m_message_header[2] << 8) | m_message_header[3];
+               m_in_message_body = true;
+               if (m_message_left == 0)
+               {
+                  end_message();
+               }
+            }
+            continue;
+         }
+
+         const size_t n = std::min<size_t>(len, m_message_left);
+         data += n;
+         len -= n;
+         m_message_left -= static_cast<uint32_t>(n);
+         if (m_message_left == 0)
+         {
+            end_message();
+         }
+      }
+   }
+
+   void end_message() noexcept
+   {
+      m_in_message_body = false;
+      if ((m_message_type == handshake_certificate) || (m_message_type == handshake_server_hello_done))
+      {
+         m_status = Status_e::Done;
+      }
+   }
+};
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+
+/**
+ * Token bucket that paces how fast new connections are started.
+ *
+ * Tokens accrue at rate per second up to burst. Every connection attempt
+ * takes one. Tokens that would overflow the bucket are counted as lag: the
+ * target rate allowed those connections but nobody was able to start them,
+ * because every slot was busy or the thread was not keeping up.
+ *
+ * A rate of 0 disables pacing.
+ **/
+class TokenBucket
+{
+public:
+   TokenBucket(double rate, double burst, unsigned long long now) noexcept :
+      m_rate(rate / 1000.0),
+      m_burst(std::max(burst, 1.0)),
+      m_tokens(std::max(burst, 1.0)),
+      m_last_refill(now)
+   {}
+
+   bool is_limited() const noexcept
+   {
+      return m_rate > 0.0;
+   }
+
+   /**
+    * Takes up to max tokens. Returns how many were taken.
+    **/
+   size_t take(size_t max, unsigned long long now) noexcept
+   {
+      if (!is_limited())
+      {
+         return max;
+      }
+
+      refill(now);
+
+      const size_t taken = std::min(max, static_cast<size_t>(m_tokens));
+      m_tokens -= static_cast<double>(taken);
+      return taken;
+   }
+
+   /**
+    * Returns tokens that were taken but not used
+    **/
+   void put_back(size_t count) noexcept
+   {
+      if (is_limited())
+      {
+         m_tokens = std::min(m_tokens + static_cast<double>(count), m_burst);
+      }
+   }
+
+   /**
+    * ms until at least one token is available
+    **/
+   int next_token_in(unsigned long long now) noexcept
+   {
+      if (!is_limited())
+      {
+         return 0;
+      }
+
+      refill(now);
+      if (m_tokens >= 1.0)
+      {
+         return 0;
+      }
+
+      return static_cast<int>((1.0 - m_tokens) / m_rate) + 1;
+   }
+
+   /**
+    * Connections the target rate allowed but that were never started
+    **/
+   unsigned long long get_lag() const noexcept
+   {
+      return static_cast<unsigned long long>(m_lag);
+   }
+
+private:
+   double m_rate;    // tokens per ms
+   double m_burst;
+   double m_tokens;
+   double m_lag = 0.0;
+   unsigned long long m_last_refill;
+
+   void refill(unsigned long long now) noexcept
+   {
+      if (now <= m_last_refill)
+      {
+         return;
+      }
+
+      m_tokens += (now - m_last_refill) * m_rate;
+      m_last_refill = now;
+
+      if (m_tokens > m_burst)
+      {
+         m_lag += m_tokens - m_burst;
+         m_tokens = m_burst;
+      }
+   }
+};
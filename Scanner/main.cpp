@@ -3,27 +3,114 @@
 #include <cstdlib>
 #include <memory>
 #include <vector>
+#include <string>
 #include <atomic>
 #include <algorithm>
+#include <utility>
 #include <openssl/ssl.h>
 #include <openssl/err.h>
+#ifdef __linux__
+   #include <sys/resource.h>
+#endif
 #include "ConnSocket.hpp"
+#include "CpuAffinity.hpp"
+#include "EventEngine.hpp"
+#include "IoUring.hpp"
+#include "ScanConfig.hpp"
+#include "SlotTable.hpp"
+#include "SynScanner.hpp"
+#include "TargetQueue.hpp"
+#include "TimerWheel.hpp"
+#include "TokenBucket.hpp"
 #include "IPSpaceSweeper.hpp"
 #include "DataStore.hpp"
 
 SSL_CTX_ptr g_ssl_ctx(nullptr, SSL_CTX_free);;
+std::unique_ptr<ClientHelloTemplate> g_hello_template;
+bool g_send_close_alert = false;
+SocketOptions g_socket_options;
 
 
-static bool g_keep_running = true;
+static std::atomic_bool g_keep_running = true;
 static std::atomic_size_t g_overall_probed = 0;
 static std::atomic_size_t g_overall_returnedData = 0;
 static std::atomic_size_t g_overall_storedResults = 0;
+static std::atomic_size_t g_overall_fastFailed = 0;
+static std::atomic_size_t g_overall_outOfPorts = 0;
+static std::atomic_size_t g_overall_pacing_lag = 0;
+static std::atomic_uint g_running_threads = 0;
+static std::atomic_size_t g_ssl_allocations = 0;
 
 
 static constexpr int stat_interval = 5000;
+static constexpr int poll_timeout = 500;
+static constexpr int starved_poll_interval = 10;
+static constexpr unsigned timer_tick = 10;
+static constexpr size_t timer_buckets = 1024;
 static constexpr size_t max_sockets = 60000;
 
 
+/**
+ * One scanner thread: where it runs and how much it probed, so every thread
+ * can report its own rate
+ **/
+struct alignas(64) ReactorStats
+{
+   std::atomic_size_t probed{ 0 };
+   int cpu = -1;   // Pinned to, or -1
+};
+
+
+/**
+ * OpenSSL allocates through these, so allocations per probe can be shown
+ **/
+static void* counting_malloc(size_t num, const char*, int)
+{
+   g_ssl_allocations.fetch_add(1, std::memory_order_relaxed);
+   return malloc(num);
+}
+
+static void* counting_realloc(void* addr, size_t num, const char*, int)
+{
+   g_ssl_allocations.fetch_add(1, std::memory_order_relaxed);
+   return realloc(addr, num);
+}
+
+static void counting_free(void* addr, const char*, int)
+{
+   free(addr);
+}
+
+/**
+ * TCP sockets of the whole host as the kernel counts them, with those in
+ * TIME_WAIT and the memory of their buffers. Empty where there is no
+ * /proc/net/sockstat.
+ **/
+static std::string kernel_socket_stats()
+{
+   char line[128] = "";
+   #ifdef __linux__
+      FILE* file = fopen("/proc/net/sockstat", "r");
+      if (file != nullptr)
+      {
+         char buf[256];
+         while (fgets(buf, sizeof(buf), file) != nullptr)
+         {
+            long inuse, orphan, tw, alloc, mem;
+            if (sscanf(buf, "TCP: inuse %ld orphan %ld tw %ld alloc %ld mem %ld", &inuse, &orphan, &tw, &alloc, &mem) == 5)
+            {
+               snprintf(line, sizeof(line), "  Kernel TCP sockets: %ld in use, %ld in TIME_WAIT, %.1f MB of buffers\n",
+                  inuse, tw, (static_cast<double>(mem) * sysconf(_SC_PAGESIZE)) / (1024.0 * 1024.0));
+               break;
+            }
+         }
+         fclose(file);
+      }
+   #endif
+   return line;
+}
+
+
 #ifdef _WIN32
    static BOOL consoleHandler(DWORD signal)
    {
@@ -39,112 +126,505 @@ static constexpr size_t max_sockets = 60000;
 #endif
 
 
-void exec_thread(DataStore& datastore, IPSpaceSweeper ip_range, const size_t sockets_by_thread)
+/**
+ * How long a scanner thread can wait for socket events: until the next
+ * connection times out or, if there are free slots to fill, until the
+ * pacer allows the next connection. A thread that is starved of targets
+ * checks back for them every starved_poll_interval ms.
+ **/
+static int next_wait(const TimerWheel& timers, TokenBucket& pacer, size_t free_slots, bool finished, bool starved)
+{
+   const auto now = GetTickCount64();
+   int timeout = timers.next_timeout(now, poll_timeout);
+   if (starved)
+   {
+      timeout = std::min(timeout, starved_poll_interval);
+   }
+   else if ((free_slots > 0) && !finished)
+   {
+      timeout = std::min(timeout, pacer.next_token_in(now));
+   }
+   return timeout;
+}
+
+
+/**
+ * Generator stage of the pipeline: sweeps a slice of the range into the
+ * queues of the scanner threads
+ **/
+void generate_targets(IPSpaceSweeper ip_range, TargetQueue::Writer output)
+{
+   target_t target;
+   while (ip_range.try_get(&target) && output.push(target, g_keep_running))
+   {}
+
+   output.close();
+}
+
+/**
+ * Pins a scanner thread before it allocates anything, so its slots, receive
+ * buffers and SSL objects are on the NUMA node of its CPU
+ **/
+static void pin_reactor(const ReactorStats& reactor)
+{
+   if ((reactor.cpu >= 0) && !pin_current_thread(reactor.cpu))
+   {
+      printf("Error pinning thread to CPU %d\n", reactor.cpu);
+   }
+}
+
+/**
+ * The targets of a scanner thread, plus those it has to try again because
+ * no local port or no room in the event engine was free for them
+ **/
+template<typename Targets>
+class RetryableTargets
+{
+public:
+   explicit RetryableTargets(Targets targets) : m_targets(std::move(targets)) {}
+
+   bool has_range_finished() const
+   {
+      return m_retry.empty() && m_targets.has_range_finished();
+   }
+
+   bool try_get(target_t* target)
+   {
+      if (!m_retry.empty())
+      {
+         *target = m_retry.back();
+         m_retry.pop_back();
+         return true;
+      }
+      return m_targets.try_get(target);
+   }
+
+   void retry(const target_t& target)
+   {
+      m_retry.push_back(target);
+   }
+
+private:
+   Targets m_targets;
+   std::vector<target_t> m_retry;
+};
+
+template<typename Targets>
+void exec_thread(DataStore& datastore, Targets input, const size_t sockets_by_thread, TokenBucket pacer, const ScanConfig& config, ReactorStats& reactor)
 {
-   std::vector<ConnSocket> socks(sockets_by_thread);
-   std::vector<pollfd>  fdas(sockets_by_thread);
+   pin_reactor(reactor);
+   RetryableTargets<Targets> targets(std::move(input));
+   SlotTable<ConnSocket> socks(sockets_by_thread);
+   EventEngine engine(sockets_by_thread, (config.io_engine == ScanConfig::IoEngine_e::Poll) ? EventEngine::Backend_e::Poll : EventEngine::Backend_e::Epoll);
+   TimerWheel timers(sockets_by_thread, timer_tick, timer_buckets, GetTickCount64());
+
+   unsigned long long reported_lag = 0;
 
    printf("Starting scan...\n");
 
+   size_t probed = 0;
+   size_t returnedData = 0;
+   size_t storedResults = 0;
+   size_t fastFailed = 0;
+   size_t outOfPorts = 0;
+   auto store_result = [&](const ConnSocket& sock)
+   {
+      const auto ret = sock.get_result();
+      if (ret.result != ConnSocket::Result_e::TCPHandshakeTimeout)
+      {
+         if (!datastore.insert(ret.ip, ret.port, ret.result, ret.data, ret.data_len))
+         {
+            printf("Error storing raw response\n");
+         }
+
+         if (ret.result == ConnSocket::Result_e::TLSHandshakeCompleted)
+         {
+            ++returnedData;
+         }
+         else if (ConnSocket::is_fast_failure(ret.result))
+         {
+            ++fastFailed;
+         }
+         ++storedResults;
+      }
+   };
+
    while (g_keep_running)
    {
-      bool is_there_active_conn = false;
-      bool need_remove = false;
-      size_t probed = 0;
-      size_t storedResults = 0;
-      for (size_t i = 0; i < socks.size(); ++i)
+      // Refill the slots that were freed since the last iteration, as far as the
+      // connection rate allows
+      size_t i;
+      target_t target;
+      bool starved = false;
+      size_t allowed = targets.has_range_finished() ? 0 : pacer.take(socks.available(), GetTickCount64());
+      while ((allowed > 0) && socks.acquire(&i))
       {
-         if (socks[i].is_connected())
+         if (!targets.try_get(&target))
          {
-            is_there_active_conn = true;
+            starved = !targets.has_range_finished();
+            socks.release(i);
+            break;
          }
-         else if (!ip_range.has_range_finished())
+
+         --allowed;
+         ++probed;
+         //printf("Testing %d.%d.%d.%d\n", target.ip & 0x000000FF, (target.ip & 0x0000FF00) >> 8, (target.ip & 0x00FF0000) >> 16, (target.ip & 0xFF000000) >> 24);
+         if (!socks[i].connect(target.ip, target.port))
          {
-            const auto ip = ip_range.get_ip();
-            ++probed;
-            //printf("Testing %d.%d.%d.%d\n", ip & 0x000000FF, (ip & 0x0000FF00) >> 8, (ip & 0x00FF0000) >> 16, (ip & 0xFF000000) >> 24);
-            if (!socks[i].connect(ip, 443))
-            {
-               printf("Error connecting socket %zd to ip 0x%08lX\n", i, ip);
-               const auto ret = socks[i].get_result();
-               if (ret.result != ConnSocket::Result_e::TCPHandshakeTimeout)
-               {
-                  if (!datastore.insert(ret.ip, ret.port, ret.result, ret.data, ret.data_len))
-                  {
-                     printf("Error storing raw response\n");
-                  }
-                  ++storedResults;
-               }
-               need_remove = true;
+            if (socks[i].has_run_out_of_ports())
+            {  // Not probed: try again once connections give their ports back
+               targets.retry(target);
+               ++outOfPorts;
+               ++allowed;
+               --probed;
+               socks.release(i);
+               starved = true;
+               break;
             }
-            else
+            else if (!socks[i].has_failed_fast())
             {
-               is_there_active_conn = true;
-               fdas[i] = socks[i].get_pollfd();
+               printf("Error connecting socket %zd to ip 0x%08lX\n", i, target.ip);
             }
+            store_result(socks[i]);
+            socks.release(i);
+         }
+         else if (!engine.watch(i, socks[i].get_pollfd()))
+         {  // Not probed either: try again once the engine can take it
+            socks[i].disconnect();
+            socks.release(i);
+            targets.retry(target);
+            ++allowed;
+            --probed;
+            starved = true;
+            break;
          }
          else
          {
-            need_remove = true;
+            timers.schedule(i, socks[i].get_deadline());
          }
       }
 
-      g_overall_probed += probed;
+      pacer.put_back(allowed);
 
-      if (!is_there_active_conn)
+      if ((socks.in_use() == 0) && targets.has_range_finished())
       {
          printf("Finished scanning\n");
          break;
       }
 
-      if (need_remove)
+      int ret = engine.wait(next_wait(timers, pacer, socks.available(), targets.has_range_finished(), starved), [&](size_t i, short revents)
+         {
+            if (socks[i].process_poll(revents))
+            {
+               store_result(socks[i]);
+               timers.cancel(i);
+               engine.unwatch(i);
+               socks[i].disconnect();
+               socks.release(i);
+            }
+            else
+            {
+               timers.schedule(i, socks[i].get_deadline());
+               engine.update_events(i, socks[i].get_pollfd());
+            }
+         });
+      if (ret < 0)
+      {
+         printf("WSAPoll error - Error=%d\n", WSAGetLastError());
+         break;
+      }
+
+      timers.expire(GetTickCount64(), [&](size_t i)
+         {
+            socks[i].set_timed_out();
+            store_result(socks[i]);
+            engine.unwatch(i);
+            socks[i].disconnect();
+            socks.release(i);
+         });
+
+      reactor.probed += probed;
+      g_overall_probed += std::exchange(probed, 0);
+      g_overall_returnedData += std::exchange(returnedData, 0);
+      g_overall_storedResults += std::exchange(storedResults, 0);
+      g_overall_fastFailed += std::exchange(fastFailed, 0);
+      g_overall_outOfPorts += std::exchange(outOfPorts, 0);
+      g_overall_pacing_lag += pacer.get_lag() - reported_lag;
+      reported_lag = pacer.get_lag();
+   }
+
+   // The last iteration can break out before adding its results
+   reactor.probed += probed;
+   g_overall_probed += probed;
+   g_overall_returnedData += returnedData;
+   g_overall_storedResults += storedResults;
+   g_overall_fastFailed += fastFailed;
+   g_overall_outOfPorts += outOfPorts;
+
+   --g_running_threads;
+}
+
+#ifdef __linux__
+/**
+ * Same scan as exec_thread, but connect, send and recv are issued through
+ * io_uring. Every socket has exactly one operation in flight, and all the
+ * operations queued during an iteration reach the kernel in one syscall.
+ **/
+template<typename Targets>
+void exec_thread_uring(DataStore& datastore, Targets input, const size_t sockets_by_thread, TokenBucket pacer, const ScanConfig&, ReactorStats& reactor)
+{
+   enum class Op_e : uint8_t
+   {
+      None,
+      Connect,
+      Send,
+      Recv,
+   };
+
+   pin_reactor(reactor);
+   RetryableTargets<Targets> targets(std::move(input));
+   SlotTable<ConnSocket> socks(sockets_by_thread);
+   std::vector<Op_e> pending(sockets_by_thread, Op_e::None);
+   std::vector<bool> cancelled(sockets_by_thread, false);
+
+   // One operation per socket, plus the cancels and the wait timeout
+   const unsigned max_inflight = static_cast<unsigned>(2 * sockets_by_thread + 2);
+   IoUring ring(4096, max_inflight);
+   TimerWheel timers(sockets_by_thread, timer_tick, timer_buckets, GetTickCount64());
+   size_t total_probed = 0;
+
+   unsigned long long reported_lag = 0;
+
+   printf("Starting scan...\n");
+
+   size_t probed = 0;
+   size_t returnedData = 0;
+   size_t storedResults = 0;
+   size_t fastFailed = 0;
+   size_t outOfPorts = 0;
+   bool ports_exhausted = false;
+   auto store_result = [&](const ConnSocket& sock)
+   {
+      const auto ret = sock.get_result();
+      if (ret.result != ConnSocket::Result_e::TCPHandshakeTimeout)
       {
-         socks.erase(std::remove_if(socks.begin(), socks.end(), [](const auto& it) {return !it.is_connected(); }), socks.end());
-         fdas.resize(socks.size());
-         for (size_t i = 0; i < socks.size(); ++i)
+         if (!datastore.insert(ret.ip, ret.port, ret.result, ret.data, ret.data_len))
          {
-            fdas[i] = socks[i].get_pollfd();
+            printf("Error storing raw response\n");
          }
+
+         if (ret.result == ConnSocket::Result_e::TLSHandshakeCompleted)
+         {
+            ++returnedData;
+         }
+         else if (ConnSocket::is_fast_failure(ret.result))
+         {
+            ++fastFailed;
+         }
+         ++storedResults;
       }
+   };
 
-      int ret = poll(fdas.data(), static_cast<unsigned long>(fdas.size()), 500);
-      if (ret < 0)
+   while (g_keep_running)
+   {
+      size_t i;
+      target_t target;
+      // Connects that found no free port complete like any other, so wait a
+      // little before the next ones instead of retrying them right away
+      bool starved = std::exchange(ports_exhausted, false);
+      size_t allowed = (targets.has_range_finished() || starved) ? 0 : pacer.take(socks.available(), GetTickCount64());
+      while ((allowed > 0) && socks.acquire(&i))
       {
-         printf("WSAPoll error - Error=%d\n", WSAGetLastError());
+         if (!targets.try_get(&target))
+         {
+            starved = !targets.has_range_finished();
+            socks.release(i);
+            break;
+         }
+
+         --allowed;
+         ++probed;
+         if (!socks[i].open(target.ip, target.port))
+         {
+            if (socks[i].has_run_out_of_ports())
+            {  // Not probed: try again once connections give their ports back
+               targets.retry(target);
+               ++outOfPorts;
+               ++allowed;
+               --probed;
+               socks.release(i);
+               starved = true;
+               break;
+            }
+            else if (!socks[i].has_failed_fast())
+            {
+               printf("Error connecting socket %zd to ip 0x%08lX\n", i, target.ip);
+            }
+            store_result(socks[i]);
+            socks.release(i);
+            continue;
+         }
+
+         const auto& peer = socks[i].get_peer();
+         if (!ring.prep_connect(socks[i].get_socket(), reinterpret_cast<const sockaddr*>(&peer), sizeof(peer), i))
+         {
+            printf("Error queueing connect for socket %zd\n", i);
+            socks[i].disconnect();
+            socks.release(i);
+            continue;
+         }
+
+         pending[i] = Op_e::Connect;
+         timers.schedule(i, socks[i].get_deadline());
+      }
+
+      pacer.put_back(allowed);
+
+      if ((socks.in_use() == 0) && targets.has_range_finished())
+      {
+         printf("Finished scanning - %zd probes in %llu io_uring_enter calls\n", total_probed + probed, ring.enter_calls());
          break;
       }
 
-      size_t returnedData = 0;
-      for (size_t i = 0; i < socks.size(); ++i)
+      int ret = ring.submit_and_wait(next_wait(timers, pacer, socks.available(), targets.has_range_finished(), starved));
+      if (ret < 0)
       {
-         if (socks[i].process_poll(fdas[i]))
+         printf("io_uring_enter error - Error=%d\n", -ret);
+         break;
+      }
+
+      ring.for_each_completion([&](__u64 user_data, int res)
          {
-            const auto ret = socks[i].get_result();
-            if (ret.result != ConnSocket::Result_e::TCPHandshakeTimeout)
+            const size_t i = static_cast<size_t>(user_data);
+            const auto op = pending[i];
+            pending[i] = Op_e::None;
+
+            if (cancelled[i])
+            {  // The result was already stored when it timed out
+               cancelled[i] = false;
+               socks[i].disconnect();
+               socks.release(i);
+               return;
+            }
+
+            bool done = false;
+            switch (op)
             {
-               if (!datastore.insert(ret.ip, ret.port, ret.result, ret.data, ret.data_len))
+               case Op_e::Connect:
+               {
+                  const char* hello;
+                  int len;
+                  done = socks[i].complete_connect(res, &hello, &len) ||
+                         !ring.prep_send(socks[i].get_socket(), hello, len, i);
+                  pending[i] = Op_e::Send;
+                  break;
+               }
+
+               case Op_e::Send:
+               case Op_e::Recv:
                {
-                  printf("Error storing raw response\n");
+                  done = (op == Op_e::Send) ? socks[i].complete_send(res) : socks[i].complete_recv(res);
+                  if (!done)
+                  {
+                     unsigned len;
+                     auto buf = socks[i].get_recv_buffer(&len);
+                     done = (len == 0) ? socks[i].fail_out_of_buffers() : !ring.prep_recv(socks[i].get_socket(), buf, len, i);
+                     pending[i] = Op_e::Recv;
+                  }
+                  break;
                }
 
-               if (ret.result == ConnSocket::Result_e::TLSHandshakeCompleted)
+               case Op_e::None:
+                  printf("Completion for idle socket %zd\n", i);
+                  return;
+            }
+
+            if (done)
+            {
+               pending[i] = Op_e::None;
+               if (socks[i].has_run_out_of_ports())
                {
-                  ++returnedData;
+                  const auto ret = socks[i].get_result();
+                  targets.retry({ ret.ip, ret.port });
+                  ++outOfPorts;
+                  --probed;
+                  ports_exhausted = true;
                }
-               ++storedResults;
+               store_result(socks[i]);
+               timers.cancel(i);
+               socks[i].disconnect();
+               socks.release(i);
             }
-            socks[i].disconnect();
-         }
-      }
+            else
+            {
+               timers.schedule(i, socks[i].get_deadline());
+            }
+         });
 
-      g_overall_returnedData += returnedData;
-      g_overall_storedResults += storedResults;
+      const auto now = GetTickCount64();
+      timers.expire(now, [&](size_t i)
+         {
+            // The socket can only be released once the kernel is done with
+            // the buffers of its pending operation, which only a cancel
+            // brings about. With the submission queue full, the timer is
+            // armed again to retry on the next tick
+            if (!ring.prep_cancel(i))
+            {
+               timers.schedule(i, now + timer_tick);
+               return;
+            }
+            socks[i].set_timed_out();
+            store_result(socks[i]);
+            cancelled[i] = true;
+         });
+
+      total_probed += probed;
+      reactor.probed += probed;
+      g_overall_probed += std::exchange(probed, 0);
+      g_overall_returnedData += std::exchange(returnedData, 0);
+      g_overall_storedResults += std::exchange(storedResults, 0);
+      g_overall_fastFailed += std::exchange(fastFailed, 0);
+      g_overall_outOfPorts += std::exchange(outOfPorts, 0);
+      g_overall_pacing_lag += pacer.get_lag() - reported_lag;
+      reported_lag = pacer.get_lag();
    }
+
+   // The last iteration can break out before adding its results
+   reactor.probed += probed;
+   g_overall_probed += probed;
+   g_overall_returnedData += returnedData;
+   g_overall_storedResults += storedResults;
+   g_overall_fastFailed += fastFailed;
+   g_overall_outOfPorts += outOfPorts;
+
+   --g_running_threads;
 }
+#endif
 
 
-int main()
+int main(int argc, char* argv[])
 {
+   ScanConfig config;
+   try
+   {
+      config = ScanConfig::parse(argc, argv);
+   }
+   catch (std::exception & e)
+   {
+      printf("%s\n", e.what());
+      ScanConfig::print_usage(argv[0]);
+      return 1;
+   }
+
+   #ifndef NDEBUG
+      // The sweep order must not change with how BlackRock computes it
+      if (!BlackRock::selftest())
+      {
+         printf("BlackRock self-test failed\n");
+         return 1;
+      }
+   #endif
+
    #ifdef _WIN32
       SetConsoleCtrlHandler(consoleHandler, TRUE);
 
@@ -157,6 +637,9 @@ int main()
       }
    #endif
 
+   // Must come before anything else allocates from OpenSSL
+   CRYPTO_set_mem_functions(counting_malloc, counting_realloc, counting_free);
+
    SSL_library_init();
    SSLeay_add_ssl_algorithms();
    SSL_load_error_strings();
@@ -164,30 +647,299 @@ int main()
    sqlite3_initialize();
 
    g_ssl_ctx.reset(SSL_CTX_new(SSLv23_client_method()));
+   g_send_close_alert = config.close_alert;
+   if (config.socket_profile == ScanConfig::SocketProfile_e::Scan)
+   {
+      g_socket_options = SocketOptions::for_scanning(sock_timeout);
+   }
+   g_socket_options.recv_icmp_errors = config.recv_icmp_errors;
+   if (config.recv_buffer > 0)
+   {
+      g_socket_options.recv_buffer = config.recv_buffer;
+   }
+   if (config.send_buffer > 0)
+   {
+      g_socket_options.send_buffer = config.send_buffer;
+   }
+   for (const auto& it : config.source_addresses)
+   {
+      const auto address = inet_addr(it.c_str());
+      if (address == INADDR_NONE)
+      {
+         printf("Invalid source address '%s'\n", it.c_str());
+         return 1;
+      }
+
+      // Else every connection would fail on its own
+      sockaddr_in local{};
+      local.sin_family = AF_INET;
+      local.sin_addr.s_addr = address;
+      const SOCKET sock = ::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+      const bool is_local = (sock != INVALID_SOCKET) && (bind(sock, reinterpret_cast<const sockaddr*>(&local), sizeof(local)) == 0);
+      const auto err = WSAGetLastError();
+      if (sock != INVALID_SOCKET)
+      {
+         closesocket(sock);
+      }
+      if (!is_local)
+      {
+         printf("Source address '%s' is not local - LastError=%d\n", it.c_str(), err);
+         return 1;
+      }
+
+      g_socket_options.source_addresses.push_back(ntohl(address));
+   }
+   if (config.hello_template)
+   {
+      try
+      {
+         g_hello_template = std::make_unique<ClientHelloTemplate>();
+      }
+      catch (std::exception & e)
+      {
+         printf("%s\n", e.what());
+         return 1;
+      }
+      printf("Sending a %zd bytes ClientHello template\n", g_hello_template->size());
+   }
+   const size_t setup_ssl_allocations = g_ssl_allocations;
 
    try
    {
       IPSpaceSweeper ip_range;
 
-      //ip_range.add_range("200.147.118.0", 24);
-      ip_range.add_range("192.0.0.0", 2);
+      const auto load_start = GetTickCount64();
+      for (const auto& it : config.include_files)
+      {
+         printf("Loaded %zd prefixes to sweep from %s\n", ip_range.load_ranges(it, false), it.c_str());
+      }
+      if (config.include_files.empty())
+      {
+         //ip_range.add_range("200.147.118.0", 24);
+         ip_range.add_range("192.0.0.0", 2);
+      }
+      if (config.exclude_reserved)
+      {
+         ip_range.exclude_reserved_ranges();
+      }
+      for (const auto& it : config.excluded_ranges)
+      {
+         unsigned long ip;
+         unsigned char mask;
+         if (!IPSpaceSweeper::parse_cidr(it, &ip, &mask))
+         {
+            throw std::invalid_argument("Invalid range to exclude '" + it + "'");
+         }
+         ip_range.exclude_range(ip, mask);
+      }
+      for (const auto& it : config.exclude_files)
+      {
+         printf("Loaded %zd prefixes to exclude from %s\n", ip_range.load_ranges(it, true), it.c_str());
+      }
+      ip_range.set_ports(config.ports);
+      ip_range.set_order((config.order == ScanConfig::Order_e::Cyclic) ? IPSpaceSweeper::Order_e::CyclicGroup : IPSpaceSweeper::Order_e::BlackRock);
+      ip_range.build();
+      printf("Sweeping %llu targets in %zd ranges, set up in %llu ms\n", static_cast<unsigned long long>(std::get<1>(ip_range.get_stats())),
+         ip_range.get_num_of_ranges(), static_cast<unsigned long long>(GetTickCount64() - load_start));
 
       DataStore datastore;
 
       std::vector<std::thread> threads;
-      const unsigned int num_of_threads =  2 * std::thread::hardware_concurrency();
+      const bool syn_discovery = (config.discovery == ScanConfig::Discovery_e::Syn);
+      const auto cpus = get_usable_cpus();
+      const unsigned int num_of_threads = config.tls_threads ? config.tls_threads :
+                                          config.pin_threads ? static_cast<unsigned>(cpus.size()) : 2 * std::thread::hardware_concurrency();
+      const unsigned int num_of_generators = (syn_discovery && (config.gen_threads == 0)) ? 1 : config.gen_threads;
       const size_t concurrency = max_sockets / num_of_threads;
 
       const auto start = GetTickCount64();
 
       printf("Starting %u threads with max_sockets = %zd\n", num_of_threads, max_sockets);
 
-      threads.reserve(num_of_threads);
-      for (unsigned int i = 0; i < num_of_threads; ++i)
+      if (config.connect_rate > 0)
       {
-         threads.emplace_back(exec_thread, std::ref(datastore), ip_range.get_slice(num_of_threads, i), concurrency);
+         printf("Pacing at %.0f %s/sec with bursts of %.0f\n", config.connect_rate,
+            syn_discovery ? "SYNs" : "connections", config.connect_burst);
       }
 
+      threads.reserve(num_of_threads + num_of_generators + 1);
+      g_running_threads = num_of_threads;
+
+      std::vector<ReactorStats> reactors(num_of_threads);
+      if (config.pin_threads)
+      {
+         for (unsigned int i = 0; i < num_of_threads; ++i)
+         {
+            reactors[i].cpu = static_cast<int>(cpus[i % cpus.size()]);
+         }
+         printf("Pinning the scanner threads to %zd CPUs\n", std::min<size_t>(num_of_threads, cpus.size()));
+      }
+
+      // What each sweeping thread gets of the range: the whole of it, taken
+      // chunk by chunk along with the other threads, or a fixed slice
+      if (config.chunk_size > 0)
+      {
+         ip_range.share_in_chunks(config.chunk_size);
+         printf("Sweeping in chunks of %zd targets\n", config.chunk_size);
+      }
+      const auto sweep_part = [&](size_t num_of_parts, size_t index)
+      {
+         return (config.chunk_size > 0) ? ip_range : ip_range.get_slice(num_of_parts, index);
+      };
+
+      std::unique_ptr<TargetQueue> pipeline;
+      #ifdef __linux__
+         std::unique_ptr<SynScanner> syn;
+         std::atomic_uint syn_transmitting = num_of_generators;
+         std::atomic_bool syn_tx_done = false;
+      #endif
+
+      if (num_of_generators == 0)
+      {  // Every scanner thread sweeps the range itself
+         auto thread_func = exec_thread<IPSpaceSweeper>;
+         #ifdef __linux__
+            if (config.io_engine == ScanConfig::IoEngine_e::IoUring)
+            {
+               thread_func = exec_thread_uring<IPSpaceSweeper>;
+            }
+         #endif
+
+         for (unsigned int i = 0; i < num_of_threads; ++i)
+         {
+            TokenBucket pacer(config.connect_rate / num_of_threads, config.connect_burst / num_of_threads, start);
+            threads.emplace_back(thread_func, std::ref(datastore), sweep_part(num_of_threads, i), concurrency, pacer, std::cref(config), std::ref(reactors[i]));
+         }
+      }
+      else
+      {  // Generator threads feed the scanner threads through the pipeline
+         printf("Starting %u target generator threads with queue depth %zd\n", num_of_generators, config.queue_depth);
+
+         if (!syn_discovery)
+         {
+            pipeline = std::make_unique<TargetQueue>(num_of_generators, num_of_threads, config.queue_depth);
+            for (unsigned int i = 0; i < num_of_generators; ++i)
+            {
+               threads.emplace_back(generate_targets, sweep_part(num_of_generators, i), pipeline->get_writer(i));
+            }
+         }
+         #ifdef __linux__
+         else
+         {
+            // Discovery paces the SYNs. Every host that answers is pushed by
+            // the only receiving thread, and gets its TLS connection right away
+            pipeline = std::make_unique<TargetQueue>(1, num_of_threads, config.queue_depth);
+
+            unsigned long source_ip = 0;
+            if (!config.syn_source.empty())
+            {
+               source_ip = ntohl(inet_addr(config.syn_source.c_str()));
+            }
+            syn = std::make_unique<SynScanner>(source_ip);
+
+            for (unsigned int i = 0; i < num_of_generators; ++i)
+            {
+               TokenBucket pacer(config.connect_rate / num_of_generators, config.connect_burst / num_of_generators, start);
+               threads.emplace_back([&, pacer](IPSpaceSweeper slice)
+                  {
+                     try
+                     {
+                        syn->transmit(slice, pacer, g_keep_running);
+                     }
+                     catch (std::exception & e)
+                     {
+                        printf("SYN transmit failed: %s\n", e.what());
+                     }
+
+                     if (--syn_transmitting == 0)
+                     {
+                        syn_tx_done = true;
+                     }
+                  }, sweep_part(num_of_generators, i));
+            }
+
+            threads.emplace_back([&](TargetQueue::Writer output)
+               {
+                  syn->receive(output, syn_tx_done, config.syn_wait, g_keep_running);
+                  output.close();
+               }, pipeline->get_writer(0));
+         }
+         #endif
+
+         auto thread_func = exec_thread<TargetQueue::Reader>;
+         #ifdef __linux__
+            if (config.io_engine == ScanConfig::IoEngine_e::IoUring)
+            {
+               thread_func = exec_thread_uring<TargetQueue::Reader>;
+            }
+         #endif
+
+         for (unsigned int i = 0; i < num_of_threads; ++i)
+         {
+            // With discovery the SYNs were paced already
+            const double rate = syn_discovery ? 0 : config.connect_rate / num_of_threads;
+            TokenBucket pacer(rate, config.connect_burst / num_of_threads, start);
+            threads.emplace_back(thread_func, std::ref(datastore), pipeline->get_reader(i), concurrency, pacer, std::cref(config), std::ref(reactors[i]));
+         }
+      }
+
+      // With SYN discovery an address is sweeped once its SYN is sent, and
+      // only the ones that answered are probed
+      const auto swept_count = [&](size_t probed) -> size_t
+      {
+         #ifdef __linux__
+            if (syn)
+            {
+               return syn->get_sent();
+            }
+         #endif
+         return probed;
+      };
+
+      const auto ssl_allocations_per_probe = [&](size_t probed)
+      {
+         return probed ? static_cast<double>(g_ssl_allocations - setup_ssl_allocations) / probed : 0.0;
+      };
+
+      const auto stage_stats = [&]() -> std::string
+      {
+         char lines[256] = "";
+         int len = 0;
+         #ifdef __linux__
+            if (syn)
+            {
+               const auto sent = syn->get_sent();
+               const auto responsive = syn->get_responsive();
+               len += snprintf(lines + len, sizeof(lines) - len, "  %zd hosts answered the SYN - %5.2f%%\n", responsive, sent ? (100.0 * responsive) / sent : 0.0);
+            }
+         #endif
+         if (pipeline)
+         {
+            snprintf(lines + len, sizeof(lines) - len, "  %zd of %zd targets queued for TLS threads, generators stalled %zd times\n",
+               pipeline->depth(), pipeline->capacity(), pipeline->get_stalls());
+         }
+         return lines;
+      };
+
+      const auto reactor_stats = [&](unsigned long long elapsed) -> std::string
+      {
+         std::string line = "  Probes/sec per thread:";
+         for (size_t i = 0; i < reactors.size(); ++i)
+         {
+            char item[48];
+            const double rate = elapsed ? static_cast<double>(reactors[i].probed) / elapsed : 0.0;
+            if (reactors[i].cpu >= 0)
+            {
+               snprintf(item, sizeof(item), " cpu%d %.0f", reactors[i].cpu, rate);
+            }
+            else
+            {
+               snprintf(item, sizeof(item), " #%zd %.0f", i, rate);
+            }
+            line += item;
+         }
+         return line + "\n";
+      };
+
       auto last_stat = GetTickCount64();
 
       while (g_keep_running)
@@ -200,7 +952,8 @@ int main()
             const auto returnedData = g_overall_returnedData.load();
             const auto storedResults = g_overall_storedResults.load();
             const auto [dummy, max_count] = ip_range.get_stats();
-            const auto percentage = (100.0 * probed) / max_count;
+            const auto sweeped = swept_count(probed);
+            const auto percentage = (100.0 * sweeped) / max_count;
             const auto data_percentage = (100.0 * returnedData) / probed;
             const auto results_percentage = (100.0 * storedResults) / probed;
             const unsigned long long elapsed = (now - start) / 1000;
@@ -214,19 +967,44 @@ int main()
             const auto remaining_min = (remaining / 60) % 60;
             const auto remaining_hou = (remaining / 3600);
 
+            const auto probes_per_sec = elapsed ? (static_cast<double>(probed) / elapsed) : 0.0;
+
             printf("\n******************** PROGRESS ********************\n"
-               "  Sweeped %zd of %lu addresses - %5.2f%%\n"
+               "  Sweeped %zd of %llu targets - %5.2f%%\n"
+               "  %.0f probes/sec\n"
+               "%s"
+               "  %.1f OpenSSL allocations per probe\n"
+               "  %.1f MB of receive buffers\n"
+               "%s"
+               "%s"
                "  %zd IPs returned data - %5.2f%%\n"
                "  %zd IPs stored some result - %5.2f%%\n"
+               "  %zd IPs refused, unreachable or filtered\n"
                "  Elapsed:   %4lldh %02lldmin %02llds\n"
                "  Remaining: %4lldh %02lldmin %02llds\n",
-               probed, max_count, percentage,
+               sweeped, static_cast<unsigned long long>(max_count), percentage,
+               probes_per_sec,
+               reactor_stats(elapsed).c_str(),
+               ssl_allocations_per_probe(probed),
+               BufferPool::get_allocated_bytes() / (1024.0 * 1024.0),
+               kernel_socket_stats().c_str(),
+               stage_stats().c_str(),
                returnedData, data_percentage,
                storedResults, results_percentage,
+               g_overall_fastFailed.load(),
                elapsed_hou, elapsed_min, elapsed_sec,
                remaining_hou, remaining_min, remaining_sec);
 
-            if (probed >= max_count)
+            if (config.connect_rate > 0)
+            {
+               printf("  Pacing: target %.0f/sec, %zd connections behind target\n", config.connect_rate, g_overall_pacing_lag.load());
+            }
+            if (g_overall_outOfPorts > 0)
+            {
+               printf("  %zd connections found no free local port and were retried\n", g_overall_outOfPorts.load());
+            }
+
+            if ((sweeped >= max_count) || (g_running_threads == 0))
             {  // Finished
                break;
             }
@@ -249,7 +1027,8 @@ int main()
       const auto returnedData = g_overall_returnedData.load();
       const auto storedResults = g_overall_storedResults.load();
       const auto [dummy, max_count] = ip_range.get_stats();
-      const auto percentage = (100.0 * probed) / max_count;
+      const auto sweeped = swept_count(probed);
+      const auto percentage = (100.0 * sweeped) / max_count;
       const auto data_percentage = (100.0 * returnedData) / probed;
       const auto results_percentage = (100.0 * storedResults) / probed;
       const unsigned long long elapsed = (GetTickCount64() - start) / 1000;
@@ -259,10 +1038,29 @@ int main()
       const auto elapsed_hou = (elapsed / 3600);
 
       printf("\n******************** FINISHED ********************\n");
-      printf("  Sweeped %zd of %lu addresses - %5.2f%%\n", probed, max_count, percentage);
+      printf("  Sweeped %zd of %llu targets - %5.2f%%\n", sweeped, static_cast<unsigned long long>(max_count), percentage);
+      printf("  %.0f probes/sec\n", elapsed ? (static_cast<double>(probed) / elapsed) : 0.0);
+      printf("%s", reactor_stats(elapsed).c_str());
+      printf("  %.1f OpenSSL allocations per probe\n", ssl_allocations_per_probe(probed));
+      #ifdef __linux__
+         rusage usage{};
+         getrusage(RUSAGE_SELF, &usage);
+         printf("  Peak RSS: %.1f MB\n", usage.ru_maxrss / 1024.0);
+      #endif
+      printf("%s", kernel_socket_stats().c_str());
+      printf("%s", stage_stats().c_str());
       printf("  %zd IPs returned data - %5.2f%%\n", returnedData, data_percentage);
       printf("  %zd IPs stored some result - %5.2f%%\n", storedResults, results_percentage);
+      printf("  %zd IPs refused, unreachable or filtered\n", g_overall_fastFailed.load());
       printf("  Elapsed: %lldh %02lldmin %02llds\n", elapsed_hou, elapsed_min, elapsed_sec );
+      if (config.connect_rate > 0)
+      {
+         printf("  Pacing: target %.0f/sec, %zd connections behind target\n", config.connect_rate, g_overall_pacing_lag.load());
+      }
+      if (g_overall_outOfPorts > 0)
+      {
+         printf("  %zd connections found no free local port and were retried\n", g_overall_outOfPorts.load());
+      }
       printf("\n**************************************************\n");
    }
    catch (std::exception & e)
@@ -57,6 +57,7 @@
 #include <ctype.h>
 
 #if defined(_MSC_VER)
+#include <intrin.h>
 #define inline _inline
 #endif
 
@@ -83,26 +84,111 @@ static constexpr unsigned char sbox[256] = {
 };
 
 
+/***************************************************************************
+ * The S-box, once for every byte of the input to READ(), already shifted to
+ * where READ() puts that byte in its result
+ ***************************************************************************/
+struct sbox_tables_t {
+   uint64_t t[8][256];
+};
+
+static constexpr sbox_tables_t make_sbox_tables()
+{
+   constexpr unsigned shift[8] = { 0, 8, 16, 24, 0 + 23, 8 + 23, 16 + 33, 24 + 33 };
+   sbox_tables_t tables{};
+   for (unsigned n = 0; n < 8; n++) {
+      for (unsigned i = 0; i < 256; i++) {
+         tables.t[n][i] = (uint64_t)sbox[i] << shift[n];
+      }
+   }
+   return tables;
+}
+
+static constexpr sbox_tables_t sbox_tables = make_sbox_tables();
+
+
 /***************************************************************************
  * The inner round/mixer function. In DES, it's a series of S-box lookups,
  * which
+ *
+ * Every byte of R is xored with the low byte of seed^r before its lookup,
+ * so that is folded into the key of the round, and the lookups of the
+ * shifted tables are just xored together.
  ***************************************************************************/
 static inline uint64_t READ(uint64_t r, uint64_t R, uint64_t seed)
 {
-   uint64_t r0, r1, r2, r3;
+   const uint64_t key = (seed << r) ^ (seed >> (64 - r)) ^ (0x0101010101010101ULL * ((seed ^ r) & 0xFF));
+
+   R ^= key;
 
-#define GETBYTE(R,n) ((((R)>>(n*8))^seed^r)&0xFF)
+   return sbox_tables.t[0][R & 0xFF] ^ sbox_tables.t[1][(R >> 8) & 0xFF]
+        ^ sbox_tables.t[2][(R >> 16) & 0xFF] ^ sbox_tables.t[3][(R >> 24) & 0xFF]
+        ^ sbox_tables.t[4][(R >> 32) & 0xFF] ^ sbox_tables.t[5][(R >> 40) & 0xFF]
+        ^ sbox_tables.t[6][(R >> 48) & 0xFF] ^ sbox_tables.t[7][R >> 56];
+}
+
+
+/***************************************************************************
+ * Division by a divisor fixed at startup, from Granlund and Montgomery,
+ * "Division by Invariant Integers using Multiplication": with t the high
+ * half of magic * n, n / d = (t + ((n - t) >> shift1)) >> shift2, exact for
+ * every 64-bit n. The rounds divide by a and b only, so BlackRock sets up
+ * both once and no round needs a DIV instruction.
+ ***************************************************************************/
+static inline uint64_t MULHI(uint64_t x, uint64_t y)
+{
+#if defined(__SIZEOF_INT128__)
+   return (uint64_t)(((unsigned __int128)x * y) >> 64);
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_ARM64))
+   return __umulh(x, y);
+#else
+   const uint64_t x0 = x & 0xFFFFFFFF, x1 = x >> 32;
+   const uint64_t y0 = y & 0xFFFFFFFF, y1 = y >> 32;
+   const uint64_t p00 = x0 * y0, p01 = x0 * y1, p10 = x1 * y0, p11 = x1 * y1;
+   const uint64_t mid = (p00 >> 32) + (p01 & 0xFFFFFFFF) + (p10 & 0xFFFFFFFF);
+   return p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+#endif
+}
 
-   R ^= (seed << r) ^ (seed >> (64 - r));
+static blackrock_divider_t DIVIDER(uint64_t d)
+{
+   blackrock_divider_t div;
+   unsigned l = 0;
+   uint64_t rem, q = 0, carry;
+   unsigned i;
+
+   /* l = ceil(log2(d)) */
+   while (l < 64 && ((uint64_t)1 << l) < d)
+      l++;
+
+   /* magic = floor(2^64 * (2^l - d) / d) + 1, by long division */
+   rem = ((l < 64) ? ((uint64_t)1 << l) : 0) - d;
+   for (i = 0; i < 64; i++) {
+      carry = rem >> 63;
+      rem <<= 1;
+      q <<= 1;
+      if (carry || rem >= d) {
+         rem -= d;
+         q |= 1;
+      }
+   }
 
-   r0 = sbox[GETBYTE(R, 0)] << 0 | sbox[GETBYTE(R, 1)] << 8;
-   r1 = (sbox[GETBYTE(R, 2)] << 16UL | sbox[GETBYTE(R, 3)] << 24UL) & 0x0ffffFFFFUL;
-   r2 = sbox[GETBYTE(R, 4)] << 0 | sbox[GETBYTE(R, 5)] << 8;
-   r3 = (sbox[GETBYTE(R, 6)] << 16UL | sbox[GETBYTE(R, 7)] << 24UL) & 0x0ffffFFFFUL;
+   div.d = d;
+   div.magic = q + 1;
+   div.shift1 = (l < 1) ? l : 1;
+   div.shift2 = (l > 1) ? l - 1 : 0;
+   return div;
+}
 
-   R = r0 ^ r1 ^ r2 << 23UL ^ r3 << 33UL;
+static inline uint64_t DIV(uint64_t n, const blackrock_divider_t* d)
+{
+   const uint64_t t = MULHI(d->magic, n);
+   return (t + ((n - t) >> d->shift1)) >> d->shift2;
+}
 
-   return R;
+static inline uint64_t MOD(uint64_t n, const blackrock_divider_t* d)
+{
+   return n - DIV(n, d) * d->d;
 }
 
 
@@ -114,48 +200,85 @@ static inline uint64_t READ(uint64_t r, uint64_t R, uint64_t seed)
  *      http://www.cs.ucdavis.edu/~rogaway/papers/subset.pdf
  * Read that paper in order to understand this code.
  ***************************************************************************/
-static inline uint64_t ENCRYPT(unsigned r, uint64_t a, uint64_t b, uint64_t m, uint64_t seed)
+static inline uint64_t ENCRYPT(unsigned r, const blackrock_divider_t* a, const blackrock_divider_t* b, uint64_t m, uint64_t seed)
 {
    uint64_t L, R;
    unsigned j;
    uint64_t tmp;
 
-   L = m % a;
-   R = m / a;
+   R = DIV(m, a);
+   L = m - R * a->d;
 
    for (j = 1; j <= r; j++) {
       if (j & 1) {
-         tmp = (L + READ(j, R, seed)) % a;
+         tmp = MOD(L + READ(j, R, seed), a);
       }
       else {
-         tmp = (L + READ(j, R, seed)) % b;
+         tmp = MOD(L + READ(j, R, seed), b);
       }
       L = R;
       R = tmp;
    }
    if (r & 1) {
-      return a * L + R;
+      return a->d * L + R;
    }
    else {
-      return a * R + L;
+      return a->d * R + L;
+   }
+}
+
+/***************************************************************************
+ * ENCRYPT() on BATCH independent inputs at once. Every round runs over all
+ * of them before the next, which lets the CPU overlap their latencies.
+ ***************************************************************************/
+#define BATCH 8
+
+static inline void ENCRYPT_BATCH(unsigned r, const blackrock_divider_t* a, const blackrock_divider_t* b, const uint64_t* m, uint64_t* c, uint64_t seed)
+{
+   uint64_t L[BATCH], R[BATCH];
+   unsigned j, k;
+   uint64_t tmp;
+   const blackrock_divider_t* d;
+
+   for (k = 0; k < BATCH; k++) {
+      R[k] = DIV(m[k], a);
+      L[k] = m[k] - R[k] * a->d;
+   }
+
+   for (j = 1; j <= r; j++) {
+      d = (j & 1) ? a : b;
+      for (k = 0; k < BATCH; k++) {
+         tmp = MOD(L[k] + READ(j, R[k], seed), d);
+         L[k] = R[k];
+         R[k] = tmp;
+      }
+   }
+
+   for (k = 0; k < BATCH; k++) {
+      if (r & 1) {
+         c[k] = a->d * L[k] + R[k];
+      }
+      else {
+         c[k] = a->d * R[k] + L[k];
+      }
    }
 }
 
 /***************************************************************************
  ***************************************************************************/
-static inline uint64_t UNENCRYPT(unsigned r, uint64_t a, uint64_t b, uint64_t m, uint64_t seed)
+static inline uint64_t UNENCRYPT(unsigned r, const blackrock_divider_t* a, const blackrock_divider_t* b, uint64_t m, uint64_t seed)
 {
    uint64_t L, R;
    unsigned j;
    uint64_t tmp;
 
    if (r & 1) {
-      R = m % a;
-      L = m / a;
+      L = DIV(m, a);
+      R = m - L * a->d;
    }
    else {
-      L = m % a;
-      R = m / a;
+      R = DIV(m, a);
+      L = m - R * a->d;
    }
 
    for (j = r; j >= 1; j--) {
@@ -163,32 +286,32 @@ static inline uint64_t UNENCRYPT(unsigned r, uint64_t a, uint64_t b, uint64_t m,
          tmp = READ(j, L, seed);
          if (tmp > R) {
             tmp = (tmp - R);
-            tmp = a - (tmp % a);
-            if (tmp == a)
+            tmp = a->d - MOD(tmp, a);
+            if (tmp == a->d)
                tmp = 0;
          }
          else {
             tmp = (R - tmp);
-            tmp %= a;
+            tmp = MOD(tmp, a);
          }
       }
       else {
          tmp = READ(j, L, seed);
          if (tmp > R) {
             tmp = (tmp - R);
-            tmp = b - (tmp % b);
-            if (tmp == b)
+            tmp = b->d - MOD(tmp, b);
+            if (tmp == b->d)
                tmp = 0;
          }
          else {
             tmp = (R - tmp);
-            tmp %= b;
+            tmp = MOD(tmp, b);
          }
       }
       R = L;
       L = tmp;
    }
-   return a * R + L;
+   return a->d * R + L;
 }
 
 
@@ -242,6 +365,8 @@ BlackRock::BlackRock( uint64_t range, uint64_t seed, unsigned rounds) noexcept
     this->rounds = rounds;
     this->seed = seed;
     this->range = range;
+    this->a_div = DIVIDER(this->a);
+    this->b_div = DIVIDER(this->b);
 }
 
 
@@ -251,9 +376,9 @@ uint64_t BlackRock::shuffle(uint64_t m) const noexcept
 {
     uint64_t c;
 
-    c = ENCRYPT(this->rounds, this->a, this->b, m, this->seed);
+    c = ENCRYPT(this->rounds, &this->a_div, &this->b_div, m, this->seed);
     while (c >= this->range)
-        c = ENCRYPT(this->rounds, this->a, this->b,  c, this->seed);
+        c = ENCRYPT(this->rounds, &this->a_div, &this->b_div, c, this->seed);
 
     return c;
 }
@@ -265,9 +390,96 @@ uint64_t BlackRock::unshuffle(uint64_t m) const noexcept
 {
     uint64_t c;
 
-    c = UNENCRYPT(this->rounds, this->a, this->b, m, this->seed);
+    c = UNENCRYPT(this->rounds, &this->a_div, &this->b_div, m, this->seed);
     while (c >= this->range)
-        c = UNENCRYPT(this->rounds, this->a, this->b,  c, this->seed);
+        c = UNENCRYPT(this->rounds, &this->a_div, &this->b_div, c, this->seed);
 
     return c;
-}
\ No newline at end of file
+}
+
+
+/***************************************************************************
+ ***************************************************************************/
+void BlackRock::shuffle_n(uint64_t first_index, size_t count, uint64_t* out) const noexcept
+{
+    uint64_t m[BATCH];
+    size_t i;
+    unsigned k;
+
+    for (i = 0; i + BATCH <= count; i += BATCH) {
+        for (k = 0; k < BATCH; k++)
+            m[k] = first_index + i + k;
+
+        ENCRYPT_BATCH(this->rounds, &this->a_div, &this->b_div, m, out + i, this->seed);
+
+        /* The few that land past the range walk the cycle on their own */
+        for (k = 0; k < BATCH; k++) {
+            while (out[i + k] >= this->range)
+                out[i + k] = ENCRYPT(this->rounds, &this->a_div, &this->b_div, out[i + k], this->seed);
+        }
+    }
+
+    for (; i < count; i++)
+        out[i] = shuffle(first_index + i);
+}
+
+
+/***************************************************************************
+ ***************************************************************************/
+bool BlackRock::selftest() noexcept
+{
+    /* Recorded from the code that divided with '%' and '/' */
+    static const struct {
+        uint64_t range;
+        uint64_t seed;
+        uint64_t index;
+        uint64_t shuffled;
+    } known[] = {
+        { 10ULL, 0x0000000000000001ULL, 0ULL, 4ULL },
+        { 10ULL, 0x0000000000000001ULL, 1ULL, 5ULL },
+        { 10ULL, 0x0000000000000001ULL, 5ULL, 9ULL },
+        { 10ULL, 0x0000000000000001ULL, 9ULL, 2ULL },
+        { 1000ULL, 0x0123456789ABCDEFULL, 0ULL, 544ULL },
+        { 1000ULL, 0x0123456789ABCDEFULL, 1ULL, 816ULL },
+        { 1000ULL, 0x0123456789ABCDEFULL, 500ULL, 353ULL },
+        { 1000ULL, 0x0123456789ABCDEFULL, 999ULL, 693ULL },
+        { 3071232629ULL, 0x000000000000002AULL, 0ULL, 1987925133ULL },
+        { 3071232629ULL, 0x000000000000002AULL, 1ULL, 1990640513ULL },
+        { 3071232629ULL, 0x000000000000002AULL, 1535616314ULL, 2026116309ULL },
+        { 3071232629ULL, 0x000000000000002AULL, 3071232628ULL, 1445270953ULL },
+        { 281474976710655ULL, 0xFEDCBA9876543210ULL, 0ULL, 161306649074867ULL },
+        { 281474976710655ULL, 0xFEDCBA9876543210ULL, 1ULL, 161305826991487ULL },
+        { 281474976710655ULL, 0xFEDCBA9876543210ULL, 140737488355327ULL, 257509476580679ULL },
+        { 281474976710655ULL, 0xFEDCBA9876543210ULL, 281474976710654ULL, 100282788068127ULL },
+    };
+    size_t i;
+    unsigned j;
+    uint64_t x = 0x9E3779B97F4A7C15ULL;
+
+    for (i = 0; i < sizeof(known) / sizeof(known[0]); i++) {
+        const BlackRock br(known[i].range, known[i].seed, 4);
+        if (br.shuffle(known[i].index) != known[i].shuffled)
+            return false;
+        if (br.unshuffle(known[i].shuffled) != known[i].index)
+            return false;
+    }
+
+    /* Small, power of two, odd and large divisors, against pseudo-random
+     * dividends and the edges of the 64-bit range */
+    for (i = 1; i < 2000; i++) {
+        const uint64_t d = (i < 1000) ? i : ((uint64_t)1 << (i % 64)) + (x >> (i % 64));
+        const blackrock_divider_t div = DIVIDER(d);
+
+        for (j = 0; j < 64; j++) {
+            uint64_t n;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            n = (j == 0) ? 0 : (j == 1) ? ~(uint64_t)0 : (j == 2) ? d - 1 : (j == 3) ? d : x >> (j % 64);
+            if (DIV(n, &div) != n / d || MOD(n, &div) != n % d)
+                return false;
+        }
+    }
+
+    return true;
+}
@@ -1,7 +1,19 @@
 #ifndef RAND_BLACKROCK_H
 #define RAND_BLACKROCK_H
+#include <stddef.h>
 #include <stdint.h>
 
+/**
+ * Unsigned 64-bit division by a divisor fixed when the BlackRock is made,
+ * as a multiply and two shifts instead of a DIV instruction
+ */
+struct blackrock_divider_t {
+    uint64_t d = 1;
+    uint64_t magic = 1;
+    unsigned shift1 = 0;
+    unsigned shift2 = 0;
+};
+
 class BlackRock {
 public:
    /**
@@ -36,12 +48,28 @@ public:
     */
    uint64_t shuffle(uint64_t index) const noexcept;
 
+   /**
+    * Shuffles the count indices from first_index on into out, with the
+    * same result as shuffle() on each. The indices go through the rounds
+    * side by side, so the divisions and S-box loads of one overlap with
+    * those of the others instead of waiting on each other.
+    */
+   void shuffle_n(uint64_t first_index, size_t count, uint64_t* out) const noexcept;
+
    /**
       * The reverse of the shuffle function above: given the shuffled/ecnrypted
       * integer, return the original index value before the shuffling/encryption.
       */
    uint64_t unshuffle(uint64_t m) const noexcept;
 
+   /**
+    * Checks shuffle() against outputs recorded from the plain division
+    * code for fixed seeds, unshuffle() against shuffle(), and the
+    * reciprocal division against the hardware one. Returns false on any
+    * difference.
+    */
+   static bool selftest() noexcept;
+
 private:
     uint64_t range = 0;
     uint64_t a = 0;
@@ -52,6 +80,8 @@ private:
     uint64_t a_mask = 0;
     uint64_t b_bits = 0;
     uint64_t b_mask = 0;
+    blackrock_divider_t a_div;
+    blackrock_divider_t b_div;
 };
 
 #endif
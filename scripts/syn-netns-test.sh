@@ -0,0 +1,78 @@
+#!/bin/bash
+# End to end test of SYN discovery (--discovery=syn) away from any real
+# network. Builds two network namespaces joined by a veth pair, starts a
+# TLS server on one port of the far end, scans that port and a closed one
+# from the near end, and checks that only the live port reaches the TLS
+# stage, i.e. that it is the only one with a row in the results.
+#
+# Needs root (network namespaces and the raw sockets of the scanner), ip,
+# openssl and sqlite3. Run from the top of the tree after "make":
+#    sudo scripts/syn-netns-test.sh [path/to/tlsscanner]
+set -eu
+
+SCANNER=$(realpath "${1:-./tlsscanner}")
+SCAN_NS=tlsscan-scan
+SRV_NS=tlsscan-srv
+SCAN_IP=10.99.0.1
+SRV_IP=10.99.0.2
+LIVE_PORT=443
+CLOSED_PORT=8443
+
+WORK=$(mktemp -d)
+SERVER_PID=
+
+cleanup()
+{
+   if [ -n "$SERVER_PID" ]; then
+      kill "$SERVER_PID" 2>/dev/null || true
+   fi
+   ip netns del "$SCAN_NS" 2>/dev/null || true
+   ip netns del "$SRV_NS" 2>/dev/null || true
+   rm -rf "$WORK"
+}
+trap cleanup EXIT
+
+if [ ! -x "$SCANNER" ]; then
+   echo "No scanner at $SCANNER, build it with make first" >&2
+   exit 1
+fi
+
+# Two namespaces, one end of the veth pair in each
+ip netns add "$SCAN_NS"
+ip netns add "$SRV_NS"
+ip link add v0 netns "$SCAN_NS" type veth peer name v1 netns "$SRV_NS"
+ip -n "$SCAN_NS" addr add "$SCAN_IP/24" dev v0
+ip -n "$SRV_NS" addr add "$SRV_IP/24" dev v1
+for ns in "$SCAN_NS" "$SRV_NS"; do
+   ip -n "$ns" link set lo up
+done
+ip -n "$SCAN_NS" link set v0 up
+ip -n "$SRV_NS" link set v1 up
+
+# A TLS server on the live port only, with a throwaway certificate
+openssl req -x509 -newkey rsa:2048 -nodes -subj /CN=test -days 1 \
+   -keyout "$WORK/key.pem" -out "$WORK/cert.pem" 2>/dev/null
+ip netns exec "$SRV_NS" openssl s_server -quiet -accept "$LIVE_PORT" \
+   -cert "$WORK/cert.pem" -key "$WORK/key.pem" < /dev/null > /dev/null 2>&1 &
+SERVER_PID=$!
+sleep 1
+
+echo "$SRV_IP/32" > "$WORK/targets.txt"
+cd "$WORK"
+ip netns exec "$SCAN_NS" "$SCANNER" --discovery=syn --syn-source="$SCAN_IP" --syn-wait=1000 \
+   --exclude-reserved=0 --include-file="$WORK/targets.txt" --ports="$LIVE_PORT,$CLOSED_PORT" > scan.log 2>&1 || {
+   cat scan.log
+   echo "FAIL: the scanner exited with an error" >&2
+   exit 1
+}
+
+# Results are stored as (ip, port, result), see DataStore.hpp and
+# ConnSocket::Result_e: 5 is TLSHandshakeCompleted
+rows=$(sqlite3 tls_observatory.db "SELECT port, result FROM raw_data ORDER BY port")
+if [ "$rows" != "$LIVE_PORT|5" ]; then
+   cat scan.log
+   echo "FAIL: expected only $LIVE_PORT|5 in the results, got:" >&2
+   echo "${rows:-(none)}" >&2
+   exit 1
+fi
+echo "PASS: only port $LIVE_PORT reached the TLS stage"